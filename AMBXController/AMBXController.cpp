@@ -8,17 +8,52 @@
 \*---------------------------------------------------------*/
 
 #include "AMBXController.h"
+#include "FrameTrace.h"
+#include "LightStateCache.h"
 #include "LogManager.h"
 #include "StringUtils.h"
 #include <cstring>
 #include <thread>
 #include <chrono>
 
+/*---------------------------------------------------------*\
+| Pause between color packets, the device drops packets    |
+| that arrive back to back                                 |
+\*---------------------------------------------------------*/
+#define AMBX_PACKET_GAP_US                  2000
+
+/*---------------------------------------------------------*\
+| Aim scheduled lights this far ahead of their target so a  |
+| late wakeup still lands in time.  A light landing more    |
+| than the window ahead of its target counts as early.      |
+\*---------------------------------------------------------*/
+#define AMBX_SCHEDULE_SLACK_US              500
+#define AMBX_DEADLINE_WINDOW_US             1000
+
+/*---------------------------------------------------------*\
+| Fade to the idle color in this many steps over this time  |
+\*---------------------------------------------------------*/
+#define AMBX_IDLE_FADE_STEPS                16
+#define AMBX_IDLE_FADE_MS                   1000
+
+static unsigned int AMBXLightCount(unsigned char light_mask)
+{
+    unsigned int count = 0;
+
+    for(unsigned int light_idx = 0; light_idx < AMBX_LIGHT_COUNT; light_idx++)
+    {
+        if(light_mask & (1 << light_idx))
+        {
+            count++;
+        }
+    }
+
+    return(count);
+}
+
 AMBXController::AMBXController(const char* path)
 {
-    initialized      = false;
-    usb_context      = nullptr;
-    dev_handle       = nullptr;
+    InitializeState();
     
     location = "USB: ";
     location += path;
@@ -93,6 +128,19 @@ AMBXController::AMBXController(const char* path)
                     }
                 }
                 
+                /*-----------------------------------------*\
+                | The port chain, unlike the address, stays |
+                | the same when the device is plugged back  |
+                | into the same port                        |
+                \*-----------------------------------------*/
+                uint8_t port_numbers[7];
+                int     port_count = libusb_get_port_numbers(device, port_numbers, sizeof(port_numbers));
+
+                for(int port_idx = 0; port_idx < port_count; port_idx++)
+                {
+                    port_path += ((port_idx == 0) ? std::to_string(bus) + "-" : std::string(".")) + std::to_string(port_numbers[port_idx]);
+                }
+
                 // Successfully opened and claimed the device
                 initialized = true;
                 break;
@@ -101,26 +149,56 @@ AMBXController::AMBXController(const char* path)
     }
     
     libusb_free_device_list(device_list, 1);
+
+    if(initialized)
+    {
+        writer_thread_run = true;
+        writer_thread     = new std::thread(&AMBXController::WriterThreadFunction, this);
+    }
+}
+
+/*---------------------------------------------------------*\
+| Simulated device, every packet goes to sim_transport      |
+| instead of the USB bus.  Used by the load generator.      |
+\*---------------------------------------------------------*/
+AMBXController::AMBXController(const std::string& sim_name, ambx_transport sim_transport)
+{
+    InitializeState();
+
+    location    = "Simulated: " + sim_name;
+    serial      = sim_name;
+    transport   = sim_transport;
+    initialized = true;
+
+    writer_thread_run = true;
+    writer_thread     = new std::thread(&AMBXController::WriterThreadFunction, this);
 }
 
 AMBXController::~AMBXController()
 {
-    if(initialized)
+    if(writer_thread != nullptr)
+    {
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex);
+            writer_thread_run = false;
+        }
+
+        wake_cv.notify_all();
+        writer_thread->join();
+        delete writer_thread;
+        writer_thread = nullptr;
+    }
+
+    if(initialized && shutdown_blackout)
     {
         try
         {
             // Turn off all lights before closing
-            unsigned int led_ids[5] = 
-            { 
-                AMBX_LIGHT_LEFT,
-                AMBX_LIGHT_RIGHT,
-                AMBX_LIGHT_WALL_LEFT,
-                AMBX_LIGHT_WALL_CENTER,
-                AMBX_LIGHT_WALL_RIGHT
-            };
-            
-            RGBColor colors[5] = { 0, 0, 0, 0, 0 };
-            SetLEDColors(led_ids, colors, 5);
+            for(unsigned int light_idx = 0; light_idx < AMBX_LIGHT_COUNT; light_idx++)
+            {
+                SendColorPacket(light_idx, 0);
+                std::this_thread::sleep_for(std::chrono::microseconds(AMBX_PACKET_GAP_US));
+            }
         }
         catch(...)
         {
@@ -156,6 +234,56 @@ AMBXController::~AMBXController()
     }
 }
 
+void AMBXController::InitializeState()
+{
+    initialized      = false;
+    usb_context      = nullptr;
+    dev_handle       = nullptr;
+    writer_thread    = nullptr;
+    writer_thread_run = false;
+    transport        = nullptr;
+
+    transfer_latency_us  = 0;
+    packet_gap_us        = AMBX_PACKET_GAP_US;
+    deadline_on_time     = 0;
+    deadline_early       = 0;
+    deadline_late        = 0;
+    deadline_dropped     = 0;
+    deadline_superseded  = 0;
+    deadline_max_late_us = 0;
+    deadline_max_early_us = 0;
+    transfer_errors      = 0;
+
+    frame_seq            = 0;
+    writer_sleeping      = false;
+
+    idle_timeout_ms      = 0;
+    idle_color_enabled   = false;
+    idle_color           = 0;
+    idle                 = false;
+    last_update          = std::chrono::steady_clock::now().time_since_epoch().count();
+    idle_entries         = 0;
+    writer_wakeups       = 0;
+    idle_wakeups         = 0;
+
+    state_entry          = -1;
+    shutdown_blackout    = true;
+
+    schedule.reserve(AMBX_SCHEDULE_DEPTH);
+
+    for(unsigned int light_idx = 0; light_idx < AMBX_LIGHT_COUNT; light_idx++)
+    {
+        frame_colors[light_idx]     = 0;
+        frame_priority[light_idx]   = AMBX_PRIORITY_NONE;
+        frame_generation[light_idx] = 0;
+        sent_generation[light_idx]  = 0;
+        sent_colors[light_idx]      = 0;
+        sent_valid[light_idx]       = false;
+        trace_frame[light_idx]      = 0;
+        trace_queued_ns[light_idx]  = 0;
+    }
+}
+
 std::string AMBXController::GetDeviceLocation()
 {
     return location;
@@ -166,60 +294,855 @@ std::string AMBXController::GetSerialString()
     return serial;
 }
 
+std::string AMBXController::GetStableKey()
+{
+    /*-----------------------------------------------------*\
+    | The amBX has no serial number, so the key follows the |
+    | USB port instead of the bus address, which changes    |
+    | every time the device is plugged in                   |
+    \*-----------------------------------------------------*/
+    if(!serial.empty())
+    {
+        return(serial);
+    }
+
+    return(port_path.empty() ? location : "USB port: " + port_path);
+}
+
 bool AMBXController::IsInitialized()
 {
     return initialized;
 }
 
-void AMBXController::SendPacket(unsigned char* packet, unsigned int size)
+ambx_deadline_stats AMBXController::GetDeadlineStats()
+{
+    ambx_deadline_stats stats;
+
+    stats.sent_on_time        = deadline_on_time.load();
+    stats.sent_early          = deadline_early.load();
+    stats.sent_late           = deadline_late.load();
+    stats.dropped             = deadline_dropped.load();
+    stats.superseded          = deadline_superseded.load();
+    stats.max_late_us         = deadline_max_late_us.load();
+    stats.max_early_us        = deadline_max_early_us.load();
+    stats.transfer_latency_us = transfer_latency_us.load();
+    stats.transfer_errors     = transfer_errors.load();
+
+    return(stats);
+}
+
+bool AMBXController::SendPacket(unsigned char* packet, unsigned int size)
 {
-    if(!initialized || dev_handle == nullptr)
+    bool sent = false;
+
+    if(!initialized || (dev_handle == nullptr && !transport))
     {
-        return;
+        return(false);
     }
     
     try
     {
         int actual_length = 0;
-        libusb_interrupt_transfer(dev_handle, AMBX_ENDPOINT_OUT, packet, size, &actual_length, 100);
+        int result;
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        {
+            FrameTraceSpan trace_span("libusb_interrupt_transfer");
+
+            if(transport)
+            {
+                result = transport(packet, size);
+            }
+            else
+            {
+                result = libusb_interrupt_transfer(dev_handle, AMBX_ENDPOINT_OUT, packet, size, &actual_length, 100);
+            }
+        }
+
+        if(result < 0)
+        {
+            transfer_errors++;
+        }
+        else
+        {
+            sent = true;
+        }
+
+        /*-------------------------------------------------*\
+        | Keep a running average of the transfer time so    |
+        | scheduled colors can be sent ahead of time        |
+        \*-------------------------------------------------*/
+        unsigned int sample_us = (unsigned int)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        unsigned int average_us = transfer_latency_us.load();
+
+        transfer_latency_us = (average_us == 0) ? sample_us : ((average_us * 7) + sample_us) / 8;
     }
     catch(...)
     {
     }
+
+    return(sent);
+}
+
+bool AMBXController::SendColorPacket(unsigned int light_idx, RGBColor color)
+{
+    ambx_color_packet color_buf = ambx_color_packets[light_idx];
+
+    color_buf[3] = RGBGetRValue(color);
+    color_buf[4] = RGBGetGValue(color);
+    color_buf[5] = RGBGetBValue(color);
+
+    return(SendPacket(color_buf.data(), AMBX_COLOR_PACKET_SIZE));
+}
+
+void AMBXController::SetIdleTimeout(unsigned int timeout_ms)
+{
+    idle_timeout_ms = timeout_ms;
+
+    /*-----------------------------------------------------*\
+    | Step the sequence by a whole frame so a writer thread |
+    | that read the old timeout does not go to sleep on it  |
+    \*-----------------------------------------------------*/
+    frame_seq.fetch_add(2);
+
+    WakeWriterThread();
+}
+
+void AMBXController::SetIdleColor(bool enabled, RGBColor color)
+{
+    idle_color         = color;
+    idle_color_enabled = enabled;
+}
+
+ambx_idle_stats AMBXController::GetIdleStats()
+{
+    ambx_idle_stats stats;
+
+    stats.idle           = idle.load();
+    stats.idle_entries   = idle_entries.load();
+    stats.writer_wakeups = writer_wakeups.load();
+    stats.idle_wakeups   = idle_wakeups.load();
+
+    return(stats);
+}
+
+void AMBXController::EnableStateCache()
+{
+    state_entry = LightStateCache::Get()->Claim(GetStableKey());
+}
+
+bool AMBXController::RestoreState(RGBColor* colors)
+{
+    int entry = state_entry.load();
+
+    if(!initialized || entry < 0)
+    {
+        return(false);
+    }
+
+    unsigned int led_ids[AMBX_LIGHT_COUNT];
+
+    for(unsigned int light_idx = 0; light_idx < AMBX_LIGHT_COUNT; light_idx++)
+    {
+        if(!LightStateCache::Get()->LoadColor(entry, light_idx, &colors[light_idx]))
+        {
+            return(false);
+        }
+
+        led_ids[light_idx] = ambx_lights[light_idx].id;
+    }
+
+    SetLEDColors(led_ids, colors, AMBX_LIGHT_COUNT, AMBX_PRIORITY_INTERACTIVE);
+
+    return(true);
+}
+
+void AMBXController::SetShutdownBlackout(bool enabled)
+{
+    shutdown_blackout = enabled;
+}
+
+void AMBXController::WakeWriterThread()
+{
+    /*-----------------------------------------------------*\
+    | Only a sleeping writer thread needs the wake mutex.   |
+    | While it is busy the new sequence number is enough,   |
+    | it reads the frame again before it goes to sleep.     |
+    | Whoever clears the flag first sends the notify.       |
+    \*-----------------------------------------------------*/
+    if(!writer_sleeping.load() || !writer_sleeping.exchange(false))
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+    }
+
+    wake_cv.notify_one();
+}
+
+bool AMBXController::WaitForWork(unsigned int seen_seq, std::chrono::steady_clock::time_point wake_time)
+{
+    /*-----------------------------------------------------*\
+    | Announce the sleep before checking the sequence.  A   |
+    | frame published after the check sees the flag and     |
+    | wakes this thread, one published before it is seen    |
+    | here and the thread does not sleep at all.            |
+    \*-----------------------------------------------------*/
+    writer_sleeping.store(true);
+
+    if(frame_seq.load() != seen_seq || !writer_thread_run.load())
+    {
+        writer_sleeping.store(false);
+        return(false);
+    }
+
+    std::unique_lock<std::mutex> lock(wake_mutex);
+
+    auto woken = [this]
+    {
+        return(!writer_sleeping.load() || !writer_thread_run.load());
+    };
+
+    if(wake_time == std::chrono::steady_clock::time_point::max())
+    {
+        wake_cv.wait(lock, woken);
+    }
+    else
+    {
+        wake_cv.wait_until(lock, wake_time, woken);
+    }
+
+    writer_sleeping.store(false);
+    writer_wakeups++;
+
+    return(true);
+}
+
+void AMBXController::BeginFrameWrite()
+{
+    /*-----------------------------------------------------*\
+    | Move the sequence from even to odd.  An odd sequence  |
+    | means another caller is mid-frame, so wait it out     |
+    \*-----------------------------------------------------*/
+    unsigned int seq = frame_seq.load(std::memory_order_relaxed);
+
+    while(true)
+    {
+        if(seq & 1)
+        {
+            std::this_thread::yield();
+            seq = frame_seq.load(std::memory_order_relaxed);
+            continue;
+        }
+
+        if(frame_seq.compare_exchange_weak(seq, seq + 1, std::memory_order_acquire, std::memory_order_relaxed))
+        {
+            break;
+        }
+    }
+
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+void AMBXController::EndFrameWrite(bool changed)
+{
+    /*-----------------------------------------------------*\
+    | Nothing was stored, so hand back the old sequence.    |
+    | The frame did not change, the idle timer keeps        |
+    | running and an idle fade is not interrupted.          |
+    \*-----------------------------------------------------*/
+    if(!changed)
+    {
+        frame_seq.fetch_sub(1);
+        return;
+    }
+
+    /*-----------------------------------------------------*\
+    | Stamp the update before publishing it, a writer that  |
+    | sends this frame must not see the old time and fade   |
+    | the frame away as idle                                |
+    \*-----------------------------------------------------*/
+    last_update.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+
+    /*-----------------------------------------------------*\
+    | Sequentially consistent so that either the writer     |
+    | thread sees the new sequence or this thread sees it   |
+    | sleeping, see WaitForWork                             |
+    \*-----------------------------------------------------*/
+    frame_seq.fetch_add(1);
+
+    WakeWriterThread();
+}
+
+bool AMBXController::QueueLEDColor(unsigned int led, RGBColor color, unsigned char priority)
+{
+    int light_idx = AMBXLightIndex(led);
+
+    if(light_idx < 0)
+    {
+        return(false);
+    }
+
+    unsigned int generation = frame_generation[light_idx].load(std::memory_order_relaxed);
+    bool         pending    = (generation != sent_generation[light_idx].load(std::memory_order_acquire));
+
+    /*-----------------------------------------------------*\
+    | Nothing to do if the light already shows this color   |
+    | and no other color is waiting to be sent              |
+    \*-----------------------------------------------------*/
+    if(!pending
+    && sent_valid[light_idx].load(std::memory_order_relaxed)
+    && sent_colors[light_idx].load(std::memory_order_relaxed) == color)
+    {
+        return(false);
+    }
+
+    if(pending && frame_priority[light_idx].load(std::memory_order_relaxed) > priority)
+    {
+        priority = frame_priority[light_idx].load(std::memory_order_relaxed);
+    }
+
+    frame_colors[light_idx].store(color, std::memory_order_relaxed);
+    frame_priority[light_idx].store(priority, std::memory_order_relaxed);
+    frame_generation[light_idx].store(generation + 1, std::memory_order_relaxed);
+    trace_frame[light_idx].store(FrameTrace::GetCurrentFrame(), std::memory_order_relaxed);
+    trace_queued_ns[light_idx].store(FrameTrace::IsEnabled() ? FrameTrace::Now() : 0, std::memory_order_relaxed);
+
+    return(true);
 }
 
-void AMBXController::SetLEDColor(unsigned int led, RGBColor color)
+unsigned int AMBXController::ReadFrame(ambx_light_snapshot* snapshot)
+{
+    unsigned int seq_start;
+    unsigned int seq_end;
+
+    do
+    {
+        seq_start = frame_seq.load(std::memory_order_acquire);
+
+        if(seq_start & 1)
+        {
+            std::this_thread::yield();
+            seq_end = seq_start + 1;
+            continue;
+        }
+
+        for(unsigned int light_idx = 0; light_idx < AMBX_LIGHT_COUNT; light_idx++)
+        {
+            snapshot[light_idx].color           = frame_colors[light_idx].load(std::memory_order_relaxed);
+            snapshot[light_idx].priority        = frame_priority[light_idx].load(std::memory_order_relaxed);
+            snapshot[light_idx].deadline        = std::chrono::steady_clock::time_point();
+            snapshot[light_idx].generation      = frame_generation[light_idx].load(std::memory_order_relaxed);
+            snapshot[light_idx].trace_frame     = trace_frame[light_idx].load(std::memory_order_relaxed);
+            snapshot[light_idx].trace_queued_ns = trace_queued_ns[light_idx].load(std::memory_order_relaxed);
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        seq_end = frame_seq.load(std::memory_order_relaxed);
+    } while(seq_start != seq_end);
+
+    for(unsigned int light_idx = 0; light_idx < AMBX_LIGHT_COUNT; light_idx++)
+    {
+        snapshot[light_idx].pending = (snapshot[light_idx].generation != sent_generation[light_idx].load(std::memory_order_relaxed));
+    }
+
+    return(seq_end);
+}
+
+int AMBXController::NextQueuedLight(ambx_light_snapshot* snapshot)
+{
+    int next_idx = -1;
+
+    for(unsigned int light_idx = 0; light_idx < AMBX_LIGHT_COUNT; light_idx++)
+    {
+        if(!snapshot[light_idx].pending)
+        {
+            continue;
+        }
+
+        if(next_idx < 0 || snapshot[light_idx].priority > snapshot[next_idx].priority)
+        {
+            next_idx = light_idx;
+        }
+    }
+
+    return(next_idx);
+}
+
+void AMBXController::ScheduleFrame(const ambx_scheduled_frame& frame)
+{
+    /*-----------------------------------------------------*\
+    | Called with schedule_mutex held                       |
+    \*-----------------------------------------------------*/
+    unsigned int frame_idx = 0;
+
+    while(frame_idx < schedule.size() && schedule[frame_idx].deadline < frame.deadline)
+    {
+        frame_idx++;
+    }
+
+    /*-----------------------------------------------------*\
+    | Same presentation time, the newer colors win          |
+    \*-----------------------------------------------------*/
+    if(frame_idx < schedule.size() && schedule[frame_idx].deadline == frame.deadline)
+    {
+        ambx_scheduled_frame& merged = schedule[frame_idx];
+
+        deadline_superseded += AMBXLightCount(merged.light_mask & frame.light_mask);
+
+        for(unsigned int light_idx = 0; light_idx < AMBX_LIGHT_COUNT; light_idx++)
+        {
+            if(frame.light_mask & (1 << light_idx))
+            {
+                merged.colors[light_idx] = frame.colors[light_idx];
+            }
+        }
+
+        merged.light_mask      |= frame.light_mask;
+        merged.trace_frame      = frame.trace_frame;
+        merged.trace_queued_ns  = frame.trace_queued_ns;
+        return;
+    }
+
+    /*-----------------------------------------------------*\
+    | Full, give up whichever frame is furthest out         |
+    \*-----------------------------------------------------*/
+    if(schedule.size() >= AMBX_SCHEDULE_DEPTH)
+    {
+        if(frame_idx == schedule.size())
+        {
+            deadline_dropped += AMBXLightCount(frame.light_mask);
+            return;
+        }
+
+        deadline_dropped += AMBXLightCount(schedule.back().light_mask);
+        schedule.pop_back();
+    }
+
+    schedule.insert(schedule.begin() + frame_idx, frame);
+}
+
+bool AMBXController::TakeScheduledLight(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point* wake_time, ambx_light_snapshot* light, int* light_idx)
+{
+    std::lock_guard<std::mutex> lock(schedule_mutex);
+
+    /*-----------------------------------------------------*\
+    | A frame that can no longer arrive in time is dropped  |
+    | rather than shown late                                |
+    \*-----------------------------------------------------*/
+    while(!schedule.empty() && now > schedule.front().deadline)
+    {
+        deadline_dropped += AMBXLightCount(schedule.front().light_mask);
+        schedule.erase(schedule.begin());
+    }
+
+    if(schedule.empty())
+    {
+        return(false);
+    }
+
+    /*-----------------------------------------------------*\
+    | Each frame has to start early enough for its own      |
+    | lights and every light due before it to reach the     |
+    | device by its deadline.  The gap after the last light |
+    | is not waited out before the deadline.                |
+    \*-----------------------------------------------------*/
+    unsigned int                            latency     = transfer_latency_us.load();
+    unsigned int                            packet_cost = latency + packet_gap_us.load();
+    unsigned int                            lights_due  = 0;
+    std::chrono::steady_clock::time_point   send_time   = std::chrono::steady_clock::time_point::max();
+
+    for(unsigned int frame_idx = 0; frame_idx < schedule.size(); frame_idx++)
+    {
+        lights_due += AMBXLightCount(schedule[frame_idx].light_mask);
+
+        std::chrono::steady_clock::time_point frame_send_time = schedule[frame_idx].deadline - std::chrono::microseconds(packet_cost * (lights_due - 1) + latency + AMBX_SCHEDULE_SLACK_US);
+
+        if(frame_send_time < send_time)
+        {
+            send_time = frame_send_time;
+        }
+    }
+
+    if(send_time > now)
+    {
+        if(send_time < *wake_time)
+        {
+            *wake_time = send_time;
+        }
+
+        return(false);
+    }
+
+    ambx_scheduled_frame& frame = schedule.front();
+
+    unsigned int next_idx = 0;
+
+    while(!(frame.light_mask & (1 << next_idx)))
+    {
+        next_idx++;
+    }
+
+    frame.light_mask &= ~(1 << next_idx);
+
+    /*-----------------------------------------------------*\
+    | The lights of a frame go out one packet apart, so     |
+    | each light is due one packet before the next one      |
+    \*-----------------------------------------------------*/
+    light->color            = frame.colors[next_idx];
+    light->priority         = AMBX_PRIORITY_BULK;
+    light->deadline         = frame.deadline - std::chrono::microseconds(packet_cost * AMBXLightCount(frame.light_mask));
+    light->generation       = 0;
+    light->pending          = true;
+    light->trace_frame      = frame.trace_frame;
+    light->trace_queued_ns  = frame.trace_queued_ns;
+
+    if(frame.light_mask == 0)
+    {
+        schedule.erase(schedule.begin());
+    }
+
+    *light_idx = next_idx;
+
+    return(true);
+}
+
+void AMBXController::SetLEDColor(unsigned int led, RGBColor color, unsigned char priority)
 {
     if(!initialized)
     {
         return;
     }
-    
-    try
+
+    FrameTraceSpan trace_span("AMBXController::SetLEDColor");
+
+    BeginFrameWrite();
+    EndFrameWrite(QueueLEDColor(led, color, priority));
+}
+
+void AMBXController::SetLEDColors(unsigned int* leds, RGBColor* colors, unsigned int count, unsigned char priority)
+{
+    if(!initialized)
     {
-        unsigned char color_buf[6] = 
-        { 
-            AMBX_PACKET_HEADER, 
-            static_cast<unsigned char>(led), 
-            AMBX_SET_COLOR,
-            RGBGetRValue(color),
-            RGBGetGValue(color),
-            RGBGetBValue(color)
-        };
-
-        SendPacket(color_buf, 6);
-        
-        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        return;
     }
-    catch(...)
+
+    FrameTraceSpan trace_span("AMBXController::SetLEDColors");
+
+    bool changed = false;
+
+    BeginFrameWrite();
+
+    for(unsigned int i = 0; i < count; i++)
     {
+        if(QueueLEDColor(leds[i], colors[i], priority))
+        {
+            changed = true;
+        }
     }
+
+    EndFrameWrite(changed);
 }
 
-void AMBXController::SetLEDColors(unsigned int* leds, RGBColor* colors, unsigned int count)
+void AMBXController::SetLEDColorsAt(unsigned int* leds, RGBColor* colors, unsigned int count, std::chrono::steady_clock::time_point deadline)
 {
+    if(!initialized)
+    {
+        return;
+    }
+
+    FrameTraceSpan trace_span("AMBXController::SetLEDColorsAt");
+
+    ambx_scheduled_frame frame;
+
+    frame.deadline        = deadline;
+    frame.light_mask      = 0;
+    frame.trace_frame     = FrameTrace::GetCurrentFrame();
+    frame.trace_queued_ns = FrameTrace::IsEnabled() ? FrameTrace::Now() : 0;
+
     for(unsigned int i = 0; i < count; i++)
     {
-        SetLEDColor(leds[i], colors[i]);
+        int light_idx = AMBXLightIndex(leds[i]);
+
+        if(light_idx >= 0)
+        {
+            frame.colors[light_idx]  = colors[i];
+            frame.light_mask        |= (1 << light_idx);
+        }
+    }
+
+    if(frame.light_mask == 0)
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(schedule_mutex);
+        ScheduleFrame(frame);
+    }
+
+    /*-----------------------------------------------------*\
+    | Then published like any other frame so the writer     |
+    | thread and an idle fade both see that something       |
+    | changed.  The schedule is left first, other callers   |
+    | never spin while this one waits for schedule_mutex.   |
+    \*-----------------------------------------------------*/
+    BeginFrameWrite();
+    EndFrameWrite(true);
+}
+
+void AMBXController::FadeToIdleColor()
+{
+    RGBColor        target    = idle_color.load();
+    RGBColor        start[AMBX_LIGHT_COUNT];
+    unsigned int    start_seq = frame_seq.load(std::memory_order_acquire);
+
+    for(unsigned int light_idx = 0; light_idx < AMBX_LIGHT_COUNT; light_idx++)
+    {
+        start[light_idx] = sent_valid[light_idx].load() ? sent_colors[light_idx].load() : 0;
+    }
+
+    for(unsigned int step = 1; step <= AMBX_IDLE_FADE_STEPS; step++)
+    {
+        for(unsigned int light_idx = 0; light_idx < AMBX_LIGHT_COUNT; light_idx++)
+        {
+            /*---------------------------------------------*\
+            | Give up as soon as a new frame arrives, the   |
+            | writer thread sends it straight away          |
+            \*---------------------------------------------*/
+            if(!writer_thread_run.load() || frame_seq.load(std::memory_order_acquire) != start_seq)
+            {
+                return;
+            }
+
+            int red   = RGBGetRValue(start[light_idx]) + (((int)RGBGetRValue(target) - (int)RGBGetRValue(start[light_idx])) * (int)step) / AMBX_IDLE_FADE_STEPS;
+            int green = RGBGetGValue(start[light_idx]) + (((int)RGBGetGValue(target) - (int)RGBGetGValue(start[light_idx])) * (int)step) / AMBX_IDLE_FADE_STEPS;
+            int blue  = RGBGetBValue(start[light_idx]) + (((int)RGBGetBValue(target) - (int)RGBGetBValue(start[light_idx])) * (int)step) / AMBX_IDLE_FADE_STEPS;
+
+            /*---------------------------------------------*\
+            | The light no longer shows its last sent color |
+            | so the next frame must not be skipped for it  |
+            \*---------------------------------------------*/
+            sent_valid[light_idx] = false;
+
+            try
+            {
+                SendColorPacket(light_idx, ToRGBColor(red, green, blue));
+            }
+            catch(...)
+            {
+            }
+
+            std::this_thread::sleep_for(std::chrono::microseconds(AMBX_PACKET_GAP_US));
+        }
+
+        writer_sleeping.store(true);
+
+        {
+            std::unique_lock<std::mutex> lock(wake_mutex);
+
+            wake_cv.wait_for(lock, std::chrono::milliseconds(AMBX_IDLE_FADE_MS / AMBX_IDLE_FADE_STEPS), [this, start_seq]
+            {
+                return(!writer_sleeping.load() || !writer_thread_run.load() || frame_seq.load() != start_seq);
+            });
+        }
+
+        writer_sleeping.store(false);
+    }
+
+    for(unsigned int light_idx = 0; light_idx < AMBX_LIGHT_COUNT; light_idx++)
+    {
+        sent_colors[light_idx] = target;
+        sent_valid[light_idx]  = true;
+    }
+}
+
+void AMBXController::WriterThreadFunction()
+{
+    const std::chrono::steady_clock::time_point unscheduled;
+
+    bool woke_up = false;
+
+    while(writer_thread_run.load())
+    {
+        ambx_light_snapshot snapshot[AMBX_LIGHT_COUNT];
+        ambx_light_snapshot light;
+        int                 light_idx;
+        bool                scheduled = false;
+
+        std::chrono::steady_clock::time_point now       = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point wake_time = std::chrono::steady_clock::time_point::max();
+
+        unsigned int seen_seq = ReadFrame(snapshot);
+
+        light_idx = NextQueuedLight(snapshot);
+
+        /*-------------------------------------------------*\
+        | Interactive colors go first, then scheduled       |
+        | colors that are due, then bulk refreshes          |
+        \*-------------------------------------------------*/
+        if(light_idx < 0 || snapshot[light_idx].priority < AMBX_PRIORITY_INTERACTIVE)
+        {
+            int scheduled_idx;
+
+            if(TakeScheduledLight(now, &wake_time, &light, &scheduled_idx))
+            {
+                light_idx = scheduled_idx;
+                scheduled = true;
+            }
+        }
+
+        if(light_idx < 0)
+        {
+            if(woke_up && idle.load())
+            {
+                idle_wakeups++;
+            }
+
+            /*---------------------------------------------*\
+            | Go idle once the quiet period is over and     |
+            | nothing is scheduled, otherwise wake up when  |
+            | it will be                                    |
+            \*---------------------------------------------*/
+            unsigned int timeout_ms = idle_timeout_ms.load();
+
+            if(!idle.load() && timeout_ms != 0 && wake_time == std::chrono::steady_clock::time_point::max())
+            {
+                std::chrono::steady_clock::time_point idle_time = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(last_update.load())) + std::chrono::milliseconds(timeout_ms);
+
+                if(now >= idle_time)
+                {
+                    idle = true;
+                    idle_entries++;
+
+                    if(idle_color_enabled.load())
+                    {
+                        FadeToIdleColor();
+                    }
+
+                    woke_up = false;
+                    continue;
+                }
+
+                if(idle_time < wake_time)
+                {
+                    wake_time = idle_time;
+                }
+            }
+
+            woke_up = WaitForWork(seen_seq, wake_time);
+            continue;
+        }
+
+        idle    = false;
+        woke_up = false;
+
+        if(!scheduled)
+        {
+            light = snapshot[light_idx];
+        }
+
+        RGBColor                                color    = light.color;
+        std::chrono::steady_clock::time_point   deadline = light.deadline;
+
+        /*-------------------------------------------------*\
+        | Mark this generation as taken before sending so   |
+        | that a color queued while it is on the wire is    |
+        | seen as pending again                             |
+        \*-------------------------------------------------*/
+        sent_colors[light_idx].store(color, std::memory_order_relaxed);
+        sent_valid[light_idx].store(true, std::memory_order_relaxed);
+
+        if(!scheduled)
+        {
+            sent_generation[light_idx].store(light.generation, std::memory_order_release);
+        }
+
+        /*-------------------------------------------------*\
+        | Trace the send as part of the frame that queued   |
+        | the color, including the time spent in the queue  |
+        \*-------------------------------------------------*/
+        FrameTrace::SetCurrentFrame(light.trace_frame);
+
+        if(light.trace_queued_ns != 0)
+        {
+            FrameTrace::Record("AMBXController::Queued", light.trace_frame, light.trace_queued_ns, FrameTrace::Now());
+        }
+
+        bool sent = false;
+
+        try
+        {
+            FrameTraceSpan trace_span("AMBXController::SendColorPacket");
+
+            sent = SendColorPacket(light_idx, color);
+        }
+        catch(...)
+        {
+        }
+
+        /*-------------------------------------------------*\
+        | The light may still show its old color after a    |
+        | failed transfer, so the next update with this     |
+        | color must not be skipped                         |
+        \*-------------------------------------------------*/
+        if(!sent)
+        {
+            sent_valid[light_idx].store(false, std::memory_order_relaxed);
+        }
+
+        int entry = state_entry.load();
+
+        if(sent && entry >= 0)
+        {
+            LightStateCache::Get()->StoreColor(entry, light_idx, color);
+        }
+
+        if(deadline != unscheduled)
+        {
+            std::chrono::steady_clock::time_point done = std::chrono::steady_clock::now();
+
+            if(done > deadline)
+            {
+                unsigned int late_us = (unsigned int)std::chrono::duration_cast<std::chrono::microseconds>(done - deadline).count();
+
+                deadline_late++;
+
+                if(late_us > deadline_max_late_us.load())
+                {
+                    deadline_max_late_us = late_us;
+                }
+            }
+            else if(done < deadline - std::chrono::microseconds(AMBX_DEADLINE_WINDOW_US))
+            {
+                unsigned int early_us = (unsigned int)std::chrono::duration_cast<std::chrono::microseconds>(deadline - done).count();
+
+                deadline_early++;
+
+                if(early_us > deadline_max_early_us.load())
+                {
+                    deadline_max_early_us = early_us;
+                }
+            }
+            else
+            {
+                deadline_on_time++;
+            }
+        }
+
+        /*-------------------------------------------------*\
+        | The gap runs over by the sleep granularity, keep  |
+        | a running average of it as well                   |
+        \*-------------------------------------------------*/
+        std::chrono::steady_clock::time_point gap_start = std::chrono::steady_clock::now();
+
+        std::this_thread::sleep_for(std::chrono::microseconds(AMBX_PACKET_GAP_US));
+
+        unsigned int gap_us = (unsigned int)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - gap_start).count();
+
+        packet_gap_us = ((packet_gap_us.load() * 7) + gap_us) / 8;
     }
 }
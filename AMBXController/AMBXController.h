@@ -10,7 +10,15 @@
 #pragma once
 
 #include "RGBController.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 #ifdef _WIN32
 #include "dependencies/libusb-1.0.27/include/libusb.h"
@@ -23,6 +31,15 @@
 #define AMBX_ENDPOINT_OUT                   0x02
 #define AMBX_PACKET_HEADER                  0xA1
 #define AMBX_SET_COLOR                      0x03
+#define AMBX_LIGHT_COUNT                    5
+#define AMBX_ZONE_COUNT                     2
+#define AMBX_COLOR_PACKET_SIZE              6
+
+/*---------------------------------------------------------*\
+| Scheduled frames that can wait for their presentation     |
+| time at once, enough for a producer a few frames ahead    |
+\*---------------------------------------------------------*/
+#define AMBX_SCHEDULE_DEPTH                 16
 
 enum
 {
@@ -33,25 +50,333 @@ enum
     AMBX_LIGHT_WALL_RIGHT   = 0x4B
 };
 
+/*---------------------------------------------------------*\
+| Device description.  Zone setup, the light index map and  |
+| the color packets are all generated from these tables at  |
+| compile time, so a new layout only needs new entries.     |
+\*---------------------------------------------------------*/
+typedef struct
+{
+    unsigned char   id;
+    const char*     name;
+    unsigned int    zone;
+} ambx_light_descriptor;
+
+typedef struct
+{
+    const char*     name;
+    zone_type       type;
+    unsigned int    start_idx;
+    unsigned int    leds_count;
+} ambx_zone_descriptor;
+
+static constexpr ambx_zone_descriptor ambx_zones[AMBX_ZONE_COUNT] =
+{
+    { "Side Lights",    ZONE_TYPE_LINEAR,   0,  2   },
+    { "Wallwasher",     ZONE_TYPE_LINEAR,   2,  3   },
+};
+
+static constexpr ambx_light_descriptor ambx_lights[AMBX_LIGHT_COUNT] =
+{
+    { AMBX_LIGHT_LEFT,          "Left",         0   },
+    { AMBX_LIGHT_RIGHT,         "Right",        0   },
+    { AMBX_LIGHT_WALL_LEFT,     "Wall Left",    1   },
+    { AMBX_LIGHT_WALL_CENTER,   "Wall Center",  1   },
+    { AMBX_LIGHT_WALL_RIGHT,    "Wall Right",   1   },
+};
+
+constexpr bool AMBXDescriptorValid()
+{
+    unsigned int next_start = 0;
+
+    for(unsigned int zone_idx = 0; zone_idx < AMBX_ZONE_COUNT; zone_idx++)
+    {
+        if(ambx_zones[zone_idx].start_idx != next_start)
+        {
+            return(false);
+        }
+
+        next_start += ambx_zones[zone_idx].leds_count;
+    }
+
+    if(next_start != AMBX_LIGHT_COUNT)
+    {
+        return(false);
+    }
+
+    for(unsigned int light_idx = 0; light_idx < AMBX_LIGHT_COUNT; light_idx++)
+    {
+        const ambx_zone_descriptor& light_zone = ambx_zones[ambx_lights[light_idx].zone];
+
+        if((ambx_lights[light_idx].id & 0x0F) != 0x0B
+        || light_idx < light_zone.start_idx
+        || light_idx >= light_zone.start_idx + light_zone.leds_count)
+        {
+            return(false);
+        }
+
+        for(unsigned int other_idx = 0; other_idx < light_idx; other_idx++)
+        {
+            if(ambx_lights[other_idx].id == ambx_lights[light_idx].id)
+            {
+                return(false);
+            }
+        }
+    }
+
+    return(true);
+}
+
+static_assert(AMBXDescriptorValid(), "amBX zones must cover every light once, in order");
+
+/*---------------------------------------------------------*\
+| Light ids are 0xNB, so the high nibble indexes straight   |
+| into the light table                                      |
+\*---------------------------------------------------------*/
+constexpr std::array<int, 16> AMBXBuildLightIndexMap()
+{
+    std::array<int, 16> index_map = {};
+
+    for(unsigned int map_idx = 0; map_idx < 16; map_idx++)
+    {
+        index_map[map_idx] = -1;
+    }
+
+    for(unsigned int light_idx = 0; light_idx < AMBX_LIGHT_COUNT; light_idx++)
+    {
+        index_map[ambx_lights[light_idx].id >> 4] = light_idx;
+    }
+
+    return(index_map);
+}
+
+static constexpr std::array<int, 16> ambx_light_index_map = AMBXBuildLightIndexMap();
+
+constexpr int AMBXLightIndex(unsigned int led)
+{
+    return(((led & 0x0F) == 0x0B && led < 0x100) ? ambx_light_index_map[led >> 4] : -1);
+}
+
+/*---------------------------------------------------------*\
+| Color packet per light, only the color bytes are filled   |
+| in at send time                                           |
+|   [AMBX_PACKET_HEADER][light id][AMBX_SET_COLOR][R][G][B] |
+\*---------------------------------------------------------*/
+typedef std::array<unsigned char, AMBX_COLOR_PACKET_SIZE> ambx_color_packet;
+
+constexpr std::array<ambx_color_packet, AMBX_LIGHT_COUNT> AMBXBuildColorPackets()
+{
+    std::array<ambx_color_packet, AMBX_LIGHT_COUNT> packets = {};
+
+    for(unsigned int light_idx = 0; light_idx < AMBX_LIGHT_COUNT; light_idx++)
+    {
+        packets[light_idx][0] = AMBX_PACKET_HEADER;
+        packets[light_idx][1] = ambx_lights[light_idx].id;
+        packets[light_idx][2] = AMBX_SET_COLOR;
+    }
+
+    return(packets);
+}
+
+static constexpr std::array<ambx_color_packet, AMBX_LIGHT_COUNT> ambx_color_packets = AMBXBuildColorPackets();
+
+/*---------------------------------------------------------*\
+| Send queue priorities.  Interactive updates are sent     |
+| before any queued bulk refresh of the other lights.      |
+\*---------------------------------------------------------*/
+enum
+{
+    AMBX_PRIORITY_NONE          = 0,
+    AMBX_PRIORITY_BULK          = 1,
+    AMBX_PRIORITY_INTERACTIVE   = 2
+};
+
+/*---------------------------------------------------------*\
+| Counters for colors queued with a presentation deadline, |
+| counted per light.  Early colors landed more than 1 ms    |
+| ahead of their deadline.  Superseded colors were          |
+| replaced by a newer color for the same light and          |
+| presentation time.                                        |
+\*---------------------------------------------------------*/
+typedef struct
+{
+    unsigned long long  sent_on_time;
+    unsigned long long  sent_early;
+    unsigned long long  sent_late;
+    unsigned long long  dropped;
+    unsigned long long  superseded;
+    unsigned int        max_early_us;
+    unsigned int        max_late_us;
+    unsigned int        transfer_latency_us;
+    unsigned long long  transfer_errors;
+} ambx_deadline_stats;
+
+/*---------------------------------------------------------*\
+| Power save counters.  While idle the writer thread only   |
+| wakes up for new colors, so idle_wakeups stays at zero    |
+| unless something woke it without work to do.              |
+\*---------------------------------------------------------*/
+typedef struct
+{
+    bool                idle;
+    unsigned long long  idle_entries;
+    unsigned long long  writer_wakeups;
+    unsigned long long  idle_wakeups;
+} ambx_idle_stats;
+
+/*---------------------------------------------------------*\
+| One light as seen by the writer thread when it takes a   |
+| snapshot of the pending frame                            |
+\*---------------------------------------------------------*/
+typedef struct
+{
+    RGBColor                                color;
+    unsigned char                           priority;
+    std::chrono::steady_clock::time_point   deadline;
+    unsigned int                            generation;
+    bool                                    pending;
+    uint64_t                                trace_frame;
+    uint64_t                                trace_queued_ns;
+} ambx_light_snapshot;
+
+/*---------------------------------------------------------*\
+| One scheduled frame, light_mask has a bit per light that  |
+| still has to be sent                                      |
+\*---------------------------------------------------------*/
+typedef struct
+{
+    std::chrono::steady_clock::time_point   deadline;
+    unsigned char                           light_mask;
+    RGBColor                                colors[AMBX_LIGHT_COUNT];
+    uint64_t                                trace_frame;
+    uint64_t                                trace_queued_ns;
+} ambx_scheduled_frame;
+
+/*---------------------------------------------------------*\
+| Packet sink used in place of libusb for simulated         |
+| devices.  Returns the number of bytes written or a        |
+| negative libusb error code.                               |
+\*---------------------------------------------------------*/
+typedef std::function<int(unsigned char* packet, unsigned int size)> ambx_transport;
+
 class AMBXController
 {
 public:
     AMBXController(const char* path);
+    AMBXController(const std::string& sim_name, ambx_transport sim_transport);
     ~AMBXController();
 
     std::string     GetDeviceLocation();
     std::string     GetSerialString();
+    std::string     GetStableKey();
     
     bool            IsInitialized();
-    void            SetLEDColor(unsigned int led, RGBColor color);
-    void            SetLEDColors(unsigned int* leds, RGBColor* colors, unsigned int count);
+    void            SetLEDColor(unsigned int led, RGBColor color, unsigned char priority = AMBX_PRIORITY_INTERACTIVE);
+    void            SetLEDColors(unsigned int* leds, RGBColor* colors, unsigned int count, unsigned char priority = AMBX_PRIORITY_BULK);
+    void            SetLEDColorsAt(unsigned int* leds, RGBColor* colors, unsigned int count, std::chrono::steady_clock::time_point deadline);
+
+    ambx_deadline_stats GetDeadlineStats();
+
+    void            SetIdleTimeout(unsigned int timeout_ms);
+    void            SetIdleColor(bool enabled, RGBColor color);
+    ambx_idle_stats GetIdleStats();
+
+    void            EnableStateCache();
+    bool            RestoreState(RGBColor* colors);
+    void            SetShutdownBlackout(bool enabled);
 
 private:
     libusb_context*          usb_context;
     libusb_device_handle*    dev_handle;
     std::string              location;
     std::string              serial;
+    std::string              port_path;
     bool                     initialized;
-    
-    void                    SendPacket(unsigned char* packet, unsigned int size);
+    ambx_transport           transport;
+
+    /*-----------------------------------------------------*\
+    | Pending frame, one slot per light, published through  |
+    | a sequence lock.  Callers only ever spin against each |
+    | other for the few stores of a frame and never against |
+    | the writer thread, which copies the whole frame and   |
+    | retries if a caller was publishing at the same time.  |
+    | A newer color for a light replaces the pending one    |
+    | instead of adding a second packet.  Publishing only   |
+    | takes wake_mutex when writer_sleeping says the writer |
+    | thread is waiting on wake_cv.                         |
+    |                                                       |
+    | Colors with a presentation time go into the schedule  |
+    | instead, under schedule_mutex.  The writer thread     |
+    | takes that mutex briefly on every pass, so a          |
+    | scheduled frame can wait on the writer, but never     |
+    | while holding the sequence lock.                      |
+    \*-----------------------------------------------------*/
+    std::thread*                            writer_thread;
+    std::atomic<bool>                       writer_thread_run;
+    std::mutex                              wake_mutex;
+    std::condition_variable                 wake_cv;
+    std::atomic<bool>                       writer_sleeping;
+    std::atomic<unsigned int>               frame_seq;
+    std::atomic<RGBColor>                   frame_colors[AMBX_LIGHT_COUNT];
+    std::atomic<unsigned char>              frame_priority[AMBX_LIGHT_COUNT];
+    std::atomic<unsigned int>               frame_generation[AMBX_LIGHT_COUNT];
+    std::atomic<unsigned int>               sent_generation[AMBX_LIGHT_COUNT];
+    std::atomic<RGBColor>                   sent_colors[AMBX_LIGHT_COUNT];
+    std::atomic<bool>                       sent_valid[AMBX_LIGHT_COUNT];
+    std::atomic<uint64_t>                   trace_frame[AMBX_LIGHT_COUNT];
+    std::atomic<uint64_t>                   trace_queued_ns[AMBX_LIGHT_COUNT];
+
+    /*-----------------------------------------------------*\
+    | Deadline scheduling.  Scheduled frames wait in the    |
+    | schedule in deadline order, so a producer can queue   |
+    | several frames ahead.                                 |
+    \*-----------------------------------------------------*/
+    std::mutex                              schedule_mutex;
+    std::vector<ambx_scheduled_frame>       schedule;
+    std::atomic<unsigned int>               transfer_latency_us;
+    std::atomic<unsigned int>               packet_gap_us;
+    std::atomic<unsigned long long>         deadline_on_time;
+    std::atomic<unsigned long long>         deadline_early;
+    std::atomic<unsigned long long>         deadline_late;
+    std::atomic<unsigned long long>         deadline_dropped;
+    std::atomic<unsigned long long>         deadline_superseded;
+    std::atomic<unsigned int>               deadline_max_early_us;
+    std::atomic<unsigned int>               deadline_max_late_us;
+    std::atomic<unsigned long long>         transfer_errors;
+
+    /*-----------------------------------------------------*\
+    | Power save.  After idle_timeout_ms without a new      |
+    | frame the writer thread optionally fades to the idle  |
+    | color once and then sleeps until the next frame.  A   |
+    | timeout of 0 disables idle tracking.                  |
+    \*-----------------------------------------------------*/
+    std::atomic<unsigned int>               idle_timeout_ms;
+    std::atomic<bool>                       idle_color_enabled;
+    std::atomic<RGBColor>                   idle_color;
+    std::atomic<bool>                       idle;
+    std::atomic<long long>                  last_update;
+    std::atomic<unsigned long long>         idle_entries;
+    std::atomic<unsigned long long>         writer_wakeups;
+    std::atomic<unsigned long long>         idle_wakeups;
+
+    /*-----------------------------------------------------*\
+    | Last frame cache entry, -1 while caching is disabled  |
+    \*-----------------------------------------------------*/
+    std::atomic<int>                        state_entry;
+    bool                                    shutdown_blackout;
+
+    void                    InitializeState();
+    void                    BeginFrameWrite();
+    void                    EndFrameWrite(bool changed);
+    bool                    QueueLEDColor(unsigned int led, RGBColor color, unsigned char priority);
+    void                    ScheduleFrame(const ambx_scheduled_frame& frame);
+    bool                    TakeScheduledLight(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point* wake_time, ambx_light_snapshot* light, int* light_idx);
+    unsigned int            ReadFrame(ambx_light_snapshot* snapshot);
+    int                     NextQueuedLight(ambx_light_snapshot* snapshot);
+    bool                    SendColorPacket(unsigned int light_idx, RGBColor color);
+    bool                    SendPacket(unsigned char* packet, unsigned int size);
+    void                    FadeToIdleColor();
+    void                    WakeWriterThread();
+    bool                    WaitForWork(unsigned int seen_seq, std::chrono::steady_clock::time_point wake_time);
+    void                    WriterThreadFunction();
 };
@@ -8,6 +8,9 @@
 \*---------------------------------------------------------*/
 
 #include "RGBController_AMBX.h"
+#include "FrameTrace.h"
+#include "ResourceManager.h"
+#include "SettingsManager.h"
 
 /**------------------------------------------------------------------*\
     @name Philips amBX
@@ -21,7 +24,7 @@
     lights and a wall-washer bar with three zones.
 \*-------------------------------------------------------------------*/
 
-RGBController_AMBX::RGBController_AMBX(AMBXController* controller_ptr)
+RGBController_AMBX::RGBController_AMBX(AMBXController* controller_ptr, bool load_settings)
 {
     controller = controller_ptr;
 
@@ -40,59 +43,118 @@ RGBController_AMBX::RGBController_AMBX(AMBXController* controller_ptr)
     modes.push_back(Direct);
 
     SetupZones();
+
+    /*-----------------------------------------------------*\
+    | The load generator skips everything the user set up,  |
+    | its simulated devices must not touch the state cache  |
+    | or open shared frame rings                            |
+    \*-----------------------------------------------------*/
+    frame_ring = nullptr;
+
+    if(load_settings)
+    {
+        LoadSettings();
+    }
 }
 
 RGBController_AMBX::~RGBController_AMBX()
 {
+    delete frame_ring;
     delete controller;
 }
 
+void RGBController_AMBX::LoadSettings()
+{
+    FrameTrace::LoadSettings();
+
+    /*-----------------------------------------------------*\
+    | Power save settings, idle_color is an RRGGBB string   |
+    \*-----------------------------------------------------*/
+    json ambx_settings = ResourceManager::get()->GetSettingsManager()->GetSettings("AMBXSettings");
+
+    try
+    {
+        if(ambx_settings.contains("idle_color"))
+        {
+            unsigned int idle_rgb = std::stoul(ambx_settings["idle_color"].get<std::string>(), nullptr, 16);
+            controller->SetIdleColor(true, ToRGBColor((idle_rgb >> 16) & 0xFF, (idle_rgb >> 8) & 0xFF, idle_rgb & 0xFF));
+        }
+
+        if(ambx_settings.contains("idle_timeout_ms"))
+        {
+            controller->SetIdleTimeout(ambx_settings["idle_timeout_ms"].get<unsigned int>());
+        }
+    }
+    catch(...)
+    {
+    }
+
+    /*-----------------------------------------------------*\
+    | Put the last frame back up straight away instead of   |
+    | waiting for a profile, optionally leaving it on when  |
+    | OpenRGB exits so there is no dark gap at all          |
+    \*-----------------------------------------------------*/
+    try
+    {
+        if(ambx_settings.contains("shutdown_blackout"))
+        {
+            controller->SetShutdownBlackout(ambx_settings["shutdown_blackout"].get<bool>());
+        }
+
+        if(ambx_settings.contains("restore_last_frame") && ambx_settings["restore_last_frame"].get<bool>())
+        {
+            RGBColor restored_colors[AMBX_LIGHT_COUNT];
+
+            controller->EnableStateCache();
+
+            if(controller->RestoreState(restored_colors))
+            {
+                for(unsigned int led_idx = 0; led_idx < AMBX_LIGHT_COUNT; led_idx++)
+                {
+                    colors[led_idx] = restored_colors[led_idx];
+                }
+            }
+        }
+    }
+    catch(...)
+    {
+    }
+
+    /*-----------------------------------------------------*\
+    | Optionally read frames straight from a local producer |
+    \*-----------------------------------------------------*/
+    if(SharedFrameRing::IsEnabled())
+    {
+        frame_ring = new SharedFrameRing(controller->GetStableKey(), [this](const RGBColor* ring_colors, unsigned int count, std::chrono::steady_clock::time_point present_time)
+        {
+            ConsumeSharedFrame(ring_colors, count, present_time);
+        });
+    }
+}
+
 void RGBController_AMBX::SetupZones()
 {
     // Set up zones
-    zone side_lights_zone;
-    side_lights_zone.name       = "Side Lights";
-    side_lights_zone.type       = ZONE_TYPE_LINEAR;
-    side_lights_zone.leds_min   = 2;
-    side_lights_zone.leds_max   = 2;
-    side_lights_zone.leds_count = 2;
-    side_lights_zone.matrix_map = NULL;
-    zones.push_back(side_lights_zone);
-    
-    zone wallwasher_zone;
-    wallwasher_zone.name       = "Wallwasher";
-    wallwasher_zone.type       = ZONE_TYPE_LINEAR;
-    wallwasher_zone.leds_min   = 3;
-    wallwasher_zone.leds_max   = 3;
-    wallwasher_zone.leds_count = 3;
-    wallwasher_zone.matrix_map = NULL;
-    zones.push_back(wallwasher_zone);
+    for(unsigned int zone_idx = 0; zone_idx < AMBX_ZONE_COUNT; zone_idx++)
+    {
+        zone new_zone;
+        new_zone.name       = ambx_zones[zone_idx].name;
+        new_zone.type       = ambx_zones[zone_idx].type;
+        new_zone.leds_min   = ambx_zones[zone_idx].leds_count;
+        new_zone.leds_max   = ambx_zones[zone_idx].leds_count;
+        new_zone.leds_count = ambx_zones[zone_idx].leds_count;
+        new_zone.matrix_map = NULL;
+        zones.push_back(new_zone);
+    }
 
     // Set up LEDs
-    led left_light;
-    left_light.name  = "Left";
-    left_light.value = AMBX_LIGHT_LEFT;
-    leds.push_back(left_light);
-
-    led right_light;
-    right_light.name  = "Right";
-    right_light.value = AMBX_LIGHT_RIGHT;
-    leds.push_back(right_light);
-
-    led wall_left;
-    wall_left.name  = "Wall Left";
-    wall_left.value = AMBX_LIGHT_WALL_LEFT;
-    leds.push_back(wall_left);
-
-    led wall_center;
-    wall_center.name  = "Wall Center";
-    wall_center.value = AMBX_LIGHT_WALL_CENTER;
-    leds.push_back(wall_center);
-
-    led wall_right;
-    wall_right.name  = "Wall Right";
-    wall_right.value = AMBX_LIGHT_WALL_RIGHT;
-    leds.push_back(wall_right);
+    for(unsigned int light_idx = 0; light_idx < AMBX_LIGHT_COUNT; light_idx++)
+    {
+        led new_led;
+        new_led.name  = ambx_lights[light_idx].name;
+        new_led.value = ambx_lights[light_idx].id;
+        leds.push_back(new_led);
+    }
 
     SetupColors();
 }
@@ -108,17 +170,26 @@ void RGBController_AMBX::DeviceUpdateLEDs()
     {
         return;
     }
+
+    FrameTrace::BeginFrame();
+    FrameTraceSpan trace_span("RGBController_AMBX::DeviceUpdateLEDs");
     
-    unsigned int led_values[5];
-    RGBColor led_colors[5];
+    /*-----------------------------------------------------*\
+    | Copy the colors out before handing them over.  The    |
+    | controller publishes the copy as one frame, so other  |
+    | threads updating at the same time never interleave    |
+    | their lights with this one                            |
+    \*-----------------------------------------------------*/
+    unsigned int led_values[AMBX_LIGHT_COUNT];
+    RGBColor led_colors[AMBX_LIGHT_COUNT];
     
-    for(unsigned int led_idx = 0; led_idx < leds.size(); led_idx++)
+    for(unsigned int led_idx = 0; led_idx < AMBX_LIGHT_COUNT; led_idx++)
     {
-        led_values[led_idx] = leds[led_idx].value;
+        led_values[led_idx] = ambx_lights[led_idx].id;
         led_colors[led_idx] = colors[led_idx];
     }
     
-    controller->SetLEDColors(led_values, led_colors, static_cast<unsigned int>(leds.size()));
+    controller->SetLEDColors(led_values, led_colors, AMBX_LIGHT_COUNT, AMBX_PRIORITY_BULK);
 }
 
 void RGBController_AMBX::UpdateZoneLEDs(int zone)
@@ -127,33 +198,29 @@ void RGBController_AMBX::UpdateZoneLEDs(int zone)
     {
         return;
     }
+
+    FrameTrace::BeginFrame();
+    FrameTraceSpan trace_span("RGBController_AMBX::UpdateZoneLEDs");
     
-    unsigned int start_idx = 0;
-    unsigned int zone_size = 0;
-    
-    // Calculate start index and size
-    for(unsigned int z_idx = 0; z_idx < zones.size(); z_idx++)
+    if(zone < 0 || zone >= AMBX_ZONE_COUNT)
     {
-        if(z_idx == (unsigned int)zone)
-        {
-            zone_size = zones[z_idx].leds_count;
-            break;
-        }
-        
-        start_idx += zones[z_idx].leds_count;
+        return;
     }
+
+    unsigned int start_idx = ambx_zones[zone].start_idx;
+    unsigned int zone_size = ambx_zones[zone].leds_count;
     
-    unsigned int led_values[5];
-    RGBColor led_colors[5];
+    unsigned int led_values[AMBX_LIGHT_COUNT];
+    RGBColor led_colors[AMBX_LIGHT_COUNT];
     
     for(unsigned int led_idx = 0; led_idx < zone_size; led_idx++)
     {
         unsigned int current_idx = start_idx + led_idx;
-        led_values[led_idx] = leds[current_idx].value;
+        led_values[led_idx] = ambx_lights[current_idx].id;
         led_colors[led_idx] = colors[current_idx];
     }
     
-    controller->SetLEDColors(led_values, led_colors, zone_size);
+    controller->SetLEDColors(led_values, led_colors, zone_size, AMBX_PRIORITY_BULK);
 }
 
 void RGBController_AMBX::UpdateSingleLED(int led)
@@ -162,10 +229,76 @@ void RGBController_AMBX::UpdateSingleLED(int led)
     {
         return;
     }
+
+    FrameTrace::BeginFrame();
+    FrameTraceSpan trace_span("RGBController_AMBX::UpdateSingleLED");
     
-    unsigned int led_value = leds[led].value;
+    if(led < 0 || led >= AMBX_LIGHT_COUNT)
+    {
+        return;
+    }
+
+    unsigned int led_value = ambx_lights[led].id;
     RGBColor color = colors[led];
-    controller->SetLEDColor(led_value, color);
+
+    // Single light changes skip ahead of any queued full refresh
+    controller->SetLEDColor(led_value, color, AMBX_PRIORITY_INTERACTIVE);
+}
+
+void RGBController_AMBX::UpdateLEDsAt(std::chrono::steady_clock::time_point present_time)
+{
+    if(!controller->IsInitialized())
+    {
+        return;
+    }
+
+    FrameTrace::BeginFrame();
+    FrameTraceSpan trace_span("RGBController_AMBX::UpdateLEDsAt");
+
+    unsigned int led_values[AMBX_LIGHT_COUNT];
+    RGBColor led_colors[AMBX_LIGHT_COUNT];
+
+    for(unsigned int led_idx = 0; led_idx < AMBX_LIGHT_COUNT; led_idx++)
+    {
+        led_values[led_idx] = ambx_lights[led_idx].id;
+        led_colors[led_idx] = colors[led_idx];
+    }
+
+    controller->SetLEDColorsAt(led_values, led_colors, AMBX_LIGHT_COUNT, present_time);
+}
+
+void RGBController_AMBX::ConsumeSharedFrame(const RGBColor* ring_colors, unsigned int count, std::chrono::steady_clock::time_point present_time)
+{
+    FrameTrace::BeginFrame();
+    FrameTraceSpan trace_span("RGBController_AMBX::ConsumeSharedFrame");
+
+    unsigned int led_values[AMBX_LIGHT_COUNT];
+    RGBColor led_colors[AMBX_LIGHT_COUNT];
+
+    if(count > AMBX_LIGHT_COUNT)
+    {
+        count = AMBX_LIGHT_COUNT;
+    }
+
+    for(unsigned int led_idx = 0; led_idx < count; led_idx++)
+    {
+        led_values[led_idx] = ambx_lights[led_idx].id;
+        led_colors[led_idx] = ring_colors[led_idx];
+    }
+
+    if(present_time == std::chrono::steady_clock::time_point())
+    {
+        controller->SetLEDColors(led_values, led_colors, count, AMBX_PRIORITY_BULK);
+    }
+    else
+    {
+        controller->SetLEDColorsAt(led_values, led_colors, count, present_time);
+    }
+}
+
+ambx_deadline_stats RGBController_AMBX::GetDeadlineStats()
+{
+    return(controller->GetDeadlineStats());
 }
 
 void RGBController_AMBX::DeviceUpdateMode()
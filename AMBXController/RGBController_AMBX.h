@@ -11,11 +11,12 @@
 
 #include "RGBController.h"
 #include "AMBXController.h"
+#include "SharedFrameRing.h"
 
 class RGBController_AMBX : public RGBController
 {
 public:
-    RGBController_AMBX(AMBXController* controller_ptr);
+    RGBController_AMBX(AMBXController* controller_ptr, bool load_settings = true);
     ~RGBController_AMBX();
 
     void        SetupZones();
@@ -24,10 +25,17 @@ public:
     void        DeviceUpdateLEDs();
     void        UpdateZoneLEDs(int zone);
     void        UpdateSingleLED(int led);
+    void        UpdateLEDsAt(std::chrono::steady_clock::time_point present_time);
     
     void        DeviceUpdateMode();
     void        SetCustomMode();
 
+    ambx_deadline_stats GetDeadlineStats();
+
 private:
-    AMBXController* controller;
+    AMBXController*    controller;
+    SharedFrameRing*   frame_ring;
+
+    void        LoadSettings();
+    void        ConsumeSharedFrame(const RGBColor* ring_colors, unsigned int count, std::chrono::steady_clock::time_point present_time);
 };
@@ -0,0 +1,330 @@
+/*---------------------------------------------------------*\
+| FrameTrace.cpp                                            |
+|                                                           |
+|   Per-frame span tracing with Chrome trace export         |
+|                                                           |
+|   This file is part of the OpenRGB project                |
+|   SPDX-License-Identifier: GPL-2.0-only                   |
+\*---------------------------------------------------------*/
+
+#include "FrameTrace.h"
+#include "LogManager.h"
+#include "ResourceManager.h"
+#include "SettingsManager.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*---------------------------------------------------------*\
+| How often to look for the trigger file that asks for a    |
+| dump while OpenRGB is running                             |
+\*---------------------------------------------------------*/
+#define FRAME_TRACE_TRIGGER_POLL_MS         500
+
+/*---------------------------------------------------------*\
+| Every thread buffer ever created.  Buffers of exited      |
+| threads are reused by new ones, so a process that keeps   |
+| starting threads holds no more buffers than it ever had   |
+| threads running at once.                                  |
+\*---------------------------------------------------------*/
+class FrameTraceRegistry
+{
+public:
+    ~FrameTraceRegistry()
+    {
+        if(trigger_thread.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(trigger_mutex);
+                trigger_run = false;
+            }
+
+            trigger_cv.notify_all();
+            trigger_thread.join();
+        }
+
+        if(!dump_file.empty())
+        {
+            FrameTrace::DumpChromeTrace(dump_file);
+        }
+    }
+
+    std::mutex                          buffers_mutex;
+    std::vector<frame_trace_buffer*>    buffers;
+    std::string                         dump_file;
+
+    std::thread                         trigger_thread;
+    std::mutex                          trigger_mutex;
+    std::condition_variable             trigger_cv;
+    bool                                trigger_run = false;
+};
+
+/*---------------------------------------------------------*\
+| Gives the calling thread's buffer back to the registry    |
+| when the thread exits                                     |
+\*---------------------------------------------------------*/
+class FrameTraceThreadBuffer
+{
+public:
+    ~FrameTraceThreadBuffer()
+    {
+        if(buffer != nullptr)
+        {
+            buffer->in_use.store(false, std::memory_order_release);
+        }
+    }
+
+    frame_trace_buffer*                 buffer = nullptr;
+};
+
+static FrameTraceRegistry                   registry;
+static std::atomic<uint64_t>                next_frame(1);
+static thread_local FrameTraceThreadBuffer  thread_buffer;
+static thread_local uint64_t                current_frame = 0;
+
+/*---------------------------------------------------------*\
+| Writes the trace whenever <dump_file>.trigger shows up,   |
+| then deletes the trigger file                             |
+\*---------------------------------------------------------*/
+static void FrameTraceTriggerThread(std::string dump_file)
+{
+    std::string                     trigger_file = dump_file + ".trigger";
+    std::unique_lock<std::mutex>    lock(registry.trigger_mutex);
+
+    while(registry.trigger_run)
+    {
+        registry.trigger_cv.wait_for(lock, std::chrono::milliseconds(FRAME_TRACE_TRIGGER_POLL_MS), []
+        {
+            return(!registry.trigger_run);
+        });
+
+        /*-------------------------------------------------*\
+        | remove() only succeeds if the file was there      |
+        \*-------------------------------------------------*/
+        if(registry.trigger_run && remove(trigger_file.c_str()) == 0)
+        {
+            lock.unlock();
+
+            if(FrameTrace::DumpChromeTrace(dump_file))
+            {
+                LOG_INFO("[FrameTrace] Trace written to %s", dump_file.c_str());
+            }
+
+            lock.lock();
+        }
+    }
+}
+
+std::atomic<bool> FrameTrace::enabled(false);
+
+void FrameTrace::LoadSettings()
+{
+    static std::once_flag settings_loaded;
+
+    std::call_once(settings_loaded, []()
+    {
+        json trace_settings = ResourceManager::get()->GetSettingsManager()->GetSettings("FrameTrace");
+
+        try
+        {
+            if(trace_settings.contains("dump_file"))
+            {
+                std::lock_guard<std::mutex> lock(registry.buffers_mutex);
+                registry.dump_file = trace_settings["dump_file"].get<std::string>();
+            }
+
+            if(trace_settings.contains("enabled"))
+            {
+                SetEnabled(trace_settings["enabled"].get<bool>());
+            }
+        }
+        catch(...)
+        {
+        }
+
+        if(IsEnabled() && !registry.dump_file.empty())
+        {
+            registry.trigger_run    = true;
+            registry.trigger_thread = std::thread(FrameTraceTriggerThread, registry.dump_file);
+        }
+    });
+}
+
+bool FrameTrace::IsEnabled()
+{
+    return(enabled.load(std::memory_order_relaxed));
+}
+
+void FrameTrace::SetEnabled(bool enable)
+{
+    enabled = enable;
+}
+
+uint64_t FrameTrace::Now()
+{
+    return((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+uint64_t FrameTrace::BeginFrame()
+{
+    current_frame = IsEnabled() ? next_frame++ : 0;
+
+    return(current_frame);
+}
+
+uint64_t FrameTrace::GetCurrentFrame()
+{
+    return(current_frame);
+}
+
+void FrameTrace::SetCurrentFrame(uint64_t frame)
+{
+    current_frame = frame;
+}
+
+frame_trace_buffer* FrameTrace::GetThreadBuffer()
+{
+    if(thread_buffer.buffer == nullptr)
+    {
+        std::lock_guard<std::mutex> lock(registry.buffers_mutex);
+
+        /*-------------------------------------------------*\
+        | Take over the buffer of a thread that has exited. |
+        | Its write count carries on, so its old spans are  |
+        | overwritten in order like any other.              |
+        \*-------------------------------------------------*/
+        for(std::size_t buffer_idx = 0; buffer_idx < registry.buffers.size(); buffer_idx++)
+        {
+            frame_trace_buffer* buffer = registry.buffers[buffer_idx];
+
+            if(!buffer->in_use.load(std::memory_order_acquire))
+            {
+                buffer->in_use        = true;
+                thread_buffer.buffer  = buffer;
+                return(buffer);
+            }
+        }
+
+        frame_trace_buffer* buffer = new frame_trace_buffer();
+
+        buffer->in_use      = true;
+        buffer->write_count = 0;
+
+        for(unsigned int span_idx = 0; span_idx < FRAME_TRACE_SPANS; span_idx++)
+        {
+            buffer->spans[span_idx].seq = 0;
+        }
+
+        buffer->thread_idx = (unsigned int)registry.buffers.size();
+        registry.buffers.push_back(buffer);
+
+        thread_buffer.buffer = buffer;
+    }
+
+    return(thread_buffer.buffer);
+}
+
+void FrameTrace::Record(const char* name, uint64_t frame, uint64_t start_ns, uint64_t end_ns)
+{
+    if(!IsEnabled())
+    {
+        return;
+    }
+
+    frame_trace_buffer* buffer = GetThreadBuffer();
+    uint64_t            index  = buffer->write_count.load(std::memory_order_relaxed);
+    frame_trace_span*   span   = &buffer->spans[index % FRAME_TRACE_SPANS];
+
+    span->seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    span->name     = name;
+    span->frame    = frame;
+    span->start_ns = start_ns;
+    span->end_ns   = end_ns;
+
+    span->seq.store(index + 1, std::memory_order_release);
+    buffer->write_count.store(index + 1, std::memory_order_release);
+}
+
+bool FrameTrace::DumpChromeTrace(const std::string& filename)
+{
+    FILE* file = fopen(filename.c_str(), "w");
+
+    if(file == nullptr)
+    {
+        LOG_WARNING("[FrameTrace] Unable to open %s", filename.c_str());
+        return(false);
+    }
+
+    std::lock_guard<std::mutex> lock(registry.buffers_mutex);
+
+    bool first_event = true;
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    for(std::size_t buffer_idx = 0; buffer_idx < registry.buffers.size(); buffer_idx++)
+    {
+        frame_trace_buffer* buffer      = registry.buffers[buffer_idx];
+        uint64_t            write_count = buffer->write_count.load(std::memory_order_acquire);
+        uint64_t            first_index = (write_count > FRAME_TRACE_SPANS) ? (write_count - FRAME_TRACE_SPANS) : 0;
+
+        fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"Thread %u\"}}", first_event ? "" : ",", buffer->thread_idx, buffer->thread_idx);
+        first_event = false;
+
+        for(uint64_t index = first_index; index < write_count; index++)
+        {
+            frame_trace_span* span = &buffer->spans[index % FRAME_TRACE_SPANS];
+
+            /*---------------------------------------------*\
+            | Skip the span if its thread overwrote it      |
+            | while it was being read                       |
+            \*---------------------------------------------*/
+            if(span->seq.load(std::memory_order_acquire) != index + 1)
+            {
+                continue;
+            }
+
+            const char* name     = span->name;
+            uint64_t    frame    = span->frame;
+            uint64_t    start_ns = span->start_ns;
+            uint64_t    end_ns   = span->end_ns;
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            if(span->seq.load(std::memory_order_relaxed) != index + 1)
+            {
+                continue;
+            }
+
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%llu}}",
+                    name,
+                    buffer->thread_idx,
+                    start_ns / 1000.0,
+                    (end_ns - start_ns) / 1000.0,
+                    (unsigned long long)frame);
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+    fclose(file);
+
+    return(true);
+}
+
+FrameTraceSpan::FrameTraceSpan(const char* span_name)
+{
+    name     = span_name;
+    start_ns = FrameTrace::IsEnabled() ? FrameTrace::Now() : 0;
+}
+
+FrameTraceSpan::~FrameTraceSpan()
+{
+    if(start_ns != 0)
+    {
+        FrameTrace::Record(name, FrameTrace::GetCurrentFrame(), start_ns, FrameTrace::Now());
+    }
+}
@@ -0,0 +1,83 @@
+/*---------------------------------------------------------*\
+| FrameTrace.h                                              |
+|                                                           |
+|   Per-frame span tracing with Chrome trace export         |
+|                                                           |
+|   This file is part of the OpenRGB project                |
+|   SPDX-License-Identifier: GPL-2.0-only                   |
+\*---------------------------------------------------------*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#define FRAME_TRACE_SPANS                   4096
+
+/*---------------------------------------------------------*\
+| One timed span, name must be a string literal.  seq is    |
+| written last and is the index of the span plus one, so a  |
+| dump can skip spans that were being overwritten while it  |
+| read them.                                                |
+\*---------------------------------------------------------*/
+typedef struct
+{
+    std::atomic<uint64_t>   seq;
+    const char*             name;
+    uint64_t                frame;
+    uint64_t                start_ns;
+    uint64_t                end_ns;
+} frame_trace_span;
+
+/*---------------------------------------------------------*\
+| Ring of spans owned by one thread at a time.  Only that   |
+| thread writes it, so recording never takes a lock.  When  |
+| the thread exits the ring is handed to the next thread    |
+| that records, its old spans stay readable until then.     |
+\*---------------------------------------------------------*/
+typedef struct
+{
+    unsigned int            thread_idx;
+    std::atomic<bool>       in_use;
+    std::atomic<uint64_t>   write_count;
+    frame_trace_span        spans[FRAME_TRACE_SPANS];
+} frame_trace_buffer;
+
+class FrameTrace
+{
+public:
+    static void         LoadSettings();
+
+    static bool         IsEnabled();
+    static void         SetEnabled(bool enabled);
+
+    static uint64_t     Now();
+    static uint64_t     BeginFrame();
+    static uint64_t     GetCurrentFrame();
+    static void         SetCurrentFrame(uint64_t frame);
+
+    static void         Record(const char* name, uint64_t frame, uint64_t start_ns, uint64_t end_ns);
+    static bool         DumpChromeTrace(const std::string& filename);
+
+private:
+    static std::atomic<bool>    enabled;
+
+    static frame_trace_buffer*  GetThreadBuffer();
+};
+
+/*---------------------------------------------------------*\
+| Records the lifetime of the object as a span of the       |
+| calling thread's current frame.  Costs one atomic load    |
+| when tracing is disabled.                                 |
+\*---------------------------------------------------------*/
+class FrameTraceSpan
+{
+public:
+    FrameTraceSpan(const char* span_name);
+    ~FrameTraceSpan();
+
+private:
+    const char*     name;
+    uint64_t        start_ns;
+};
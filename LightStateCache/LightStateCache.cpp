@@ -0,0 +1,227 @@
+/*---------------------------------------------------------*\
+| LightStateCache.cpp                                       |
+|                                                           |
+|   Memory mapped cache of the last colors sent to a device |
+|                                                           |
+|   This file is part of the OpenRGB project                |
+|   SPDX-License-Identifier: GPL-2.0-only                   |
+\*---------------------------------------------------------*/
+
+#include "LightStateCache.h"
+#include "LogManager.h"
+#include "ResourceManager.h"
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+LightStateCache* LightStateCache::Get()
+{
+    static LightStateCache instance;
+
+    return(&instance);
+}
+
+LightStateCache::LightStateCache()
+{
+    state          = nullptr;
+    file_handle    = nullptr;
+    mapping_handle = nullptr;
+
+    std::string filename = (ResourceManager::get()->GetConfigurationDirectory() / LIGHT_STATE_CACHE_FILENAME).string();
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if(file == INVALID_HANDLE_VALUE)
+    {
+        LOG_WARNING("[LightStateCache] Unable to open %s", filename.c_str());
+        return;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, sizeof(light_state_file), NULL);
+
+    if(mapping == NULL)
+    {
+        CloseHandle(file);
+        return;
+    }
+
+    void* view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(light_state_file));
+
+    if(view == NULL)
+    {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return;
+    }
+
+    file_handle    = file;
+    mapping_handle = mapping;
+#else
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+
+    if(fd < 0)
+    {
+        LOG_WARNING("[LightStateCache] Unable to open %s", filename.c_str());
+        return;
+    }
+
+    if(ftruncate(fd, sizeof(light_state_file)) != 0)
+    {
+        close(fd);
+        return;
+    }
+
+    void* view = mmap(NULL, sizeof(light_state_file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if(view == MAP_FAILED)
+    {
+        return;
+    }
+#endif
+
+    state = static_cast<light_state_file*>(view);
+
+    /*-----------------------------------------------------*\
+    | Start over if the file is new or from another layout  |
+    \*-----------------------------------------------------*/
+    if(state->magic != LIGHT_STATE_CACHE_MAGIC
+    || state->version != LIGHT_STATE_CACHE_VERSION
+    || state->entry_count != LIGHT_STATE_CACHE_ENTRIES
+    || state->max_leds != LIGHT_STATE_CACHE_MAX_LEDS)
+    {
+        memset(state, 0, sizeof(light_state_file));
+
+        state->magic       = LIGHT_STATE_CACHE_MAGIC;
+        state->version     = LIGHT_STATE_CACHE_VERSION;
+        state->entry_count = LIGHT_STATE_CACHE_ENTRIES;
+        state->max_leds    = LIGHT_STATE_CACHE_MAX_LEDS;
+    }
+}
+
+LightStateCache::~LightStateCache()
+{
+#ifdef _WIN32
+    if(state != nullptr)
+    {
+        FlushViewOfFile(state, sizeof(light_state_file));
+        UnmapViewOfFile(state);
+    }
+
+    if(mapping_handle != nullptr)
+    {
+        CloseHandle(static_cast<HANDLE>(mapping_handle));
+    }
+
+    if(file_handle != nullptr)
+    {
+        CloseHandle(static_cast<HANDLE>(file_handle));
+    }
+#else
+    if(state != nullptr)
+    {
+        munmap(state, sizeof(light_state_file));
+    }
+#endif
+}
+
+int LightStateCache::Claim(const std::string& key)
+{
+    if(state == nullptr || key.empty())
+    {
+        return(-1);
+    }
+
+    std::lock_guard<std::mutex> lock(claim_mutex);
+
+    int found_idx  = -1;
+    int oldest_idx = 0;
+
+    for(unsigned int entry_idx = 0; entry_idx < LIGHT_STATE_CACHE_ENTRIES; entry_idx++)
+    {
+        if(strncmp(state->entries[entry_idx].key, key.c_str(), LIGHT_STATE_CACHE_KEY_LENGTH - 1) == 0)
+        {
+            found_idx = entry_idx;
+            break;
+        }
+
+        if(state->entries[entry_idx].claimed < state->entries[oldest_idx].claimed)
+        {
+            oldest_idx = entry_idx;
+        }
+    }
+
+    /*-----------------------------------------------------*\
+    | Reuse the least recently claimed entry for a new key  |
+    \*-----------------------------------------------------*/
+    if(found_idx < 0)
+    {
+        found_idx = oldest_idx;
+
+        memset(&state->entries[found_idx], 0, sizeof(light_state_entry));
+        strncpy(state->entries[found_idx].key, key.c_str(), LIGHT_STATE_CACHE_KEY_LENGTH - 1);
+    }
+
+    state->entries[found_idx].claimed = ++state->claim_count;
+
+    return(found_idx);
+}
+
+bool LightStateCache::LoadColor(int entry, unsigned int led, RGBColor* color)
+{
+    if(state == nullptr || entry < 0 || led >= LIGHT_STATE_CACHE_MAX_LEDS)
+    {
+        return(false);
+    }
+
+    if(!(state->entries[entry].valid_leds & (1 << led)))
+    {
+        return(false);
+    }
+
+    *color = state->entries[entry].colors[led];
+
+    return(true);
+}
+
+bool LightStateCache::LoadIntensity(int entry, unsigned char* intensity)
+{
+    if(state == nullptr || entry < 0 || !state->entries[entry].intensity_valid)
+    {
+        return(false);
+    }
+
+    *intensity = state->entries[entry].intensity;
+
+    return(true);
+}
+
+void LightStateCache::StoreColor(int entry, unsigned int led, RGBColor color)
+{
+    if(state == nullptr || entry < 0 || led >= LIGHT_STATE_CACHE_MAX_LEDS)
+    {
+        return;
+    }
+
+    state->entries[entry].colors[led]  = color;
+    state->entries[entry].valid_leds  |= (1 << led);
+}
+
+void LightStateCache::StoreIntensity(int entry, unsigned char intensity)
+{
+    if(state == nullptr || entry < 0)
+    {
+        return;
+    }
+
+    state->entries[entry].intensity       = intensity;
+    state->entries[entry].intensity_valid = 1;
+}
@@ -0,0 +1,70 @@
+/*---------------------------------------------------------*\
+| LightStateCache.h                                         |
+|                                                           |
+|   Memory mapped cache of the last colors sent to a device |
+|                                                           |
+|   This file is part of the OpenRGB project                |
+|   SPDX-License-Identifier: GPL-2.0-only                   |
+\*---------------------------------------------------------*/
+
+#pragma once
+
+#include "RGBController.h"
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#define LIGHT_STATE_CACHE_MAGIC             0x4C534343
+#define LIGHT_STATE_CACHE_VERSION           1
+#define LIGHT_STATE_CACHE_ENTRIES           16
+#define LIGHT_STATE_CACHE_KEY_LENGTH        96
+#define LIGHT_STATE_CACHE_MAX_LEDS          8
+#define LIGHT_STATE_CACHE_FILENAME          "LightStateCache.bin"
+
+/*---------------------------------------------------------*\
+| File layout.  Each device owns one entry, found by its    |
+| key (serial, or location when there is no serial), and    |
+| is the only writer of that entry.                         |
+\*---------------------------------------------------------*/
+typedef struct
+{
+    char                key[LIGHT_STATE_CACHE_KEY_LENGTH];
+    uint64_t            claimed;
+    uint32_t            colors[LIGHT_STATE_CACHE_MAX_LEDS];
+    uint32_t            valid_leds;
+    uint8_t             intensity;
+    uint8_t             intensity_valid;
+    uint8_t             reserved[2];
+} light_state_entry;
+
+typedef struct
+{
+    uint32_t            magic;
+    uint32_t            version;
+    uint32_t            entry_count;
+    uint32_t            max_leds;
+    uint64_t            claim_count;
+    light_state_entry   entries[LIGHT_STATE_CACHE_ENTRIES];
+} light_state_file;
+
+class LightStateCache
+{
+public:
+    static LightStateCache* Get();
+
+    int             Claim(const std::string& key);
+
+    bool            LoadColor(int entry, unsigned int led, RGBColor* color);
+    bool            LoadIntensity(int entry, unsigned char* intensity);
+    void            StoreColor(int entry, unsigned int led, RGBColor color);
+    void            StoreIntensity(int entry, unsigned char intensity);
+
+private:
+    LightStateCache();
+    ~LightStateCache();
+
+    std::mutex          claim_mutex;
+    light_state_file*   state;
+    void*               file_handle;
+    void*               mapping_handle;
+};
@@ -8,22 +8,228 @@
 \*---------------------------------------------------------*/
 
 #include "MadCatzCyborgController.h"
+#include "FrameTrace.h"
+#include "LightStateCache.h"
 #include "StringUtils.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
 #include <cstring>
 
-MadCatzCyborgController::MadCatzCyborgController(hid_device* dev_handle, const char* path)
+#ifdef __linux__
+#include <climits>
+#include <cstdlib>
+#endif
+
+/*---------------------------------------------------------*\
+| Fade to the idle color in this many steps over this time  |
+\*---------------------------------------------------------*/
+#define MADCATZ_CYBORG_IDLE_FADE_STEPS      16
+#define MADCATZ_CYBORG_IDLE_FADE_MS         1000
+
+/*---------------------------------------------------------*\
+| Effect timer limits.  The worker wakes often enough to    |
+| catch every intensity step, but no more than this often.  |
+\*---------------------------------------------------------*/
+#define MADCATZ_CYBORG_EFFECT_TICK_MIN_MS   10
+#define MADCATZ_CYBORG_EFFECT_TICK_MAX_MS   50
+
+/*---------------------------------------------------------*\
+| Send scheduled colors this much earlier than the report   |
+| time alone needs, thread wakeups are not exact.  A color  |
+| landing more than the window ahead counts as early.       |
+\*---------------------------------------------------------*/
+#define MADCATZ_CYBORG_SCHEDULE_SLACK_US    500
+#define MADCATZ_CYBORG_DEADLINE_WINDOW_US   1000
+
+/*---------------------------------------------------------*\
+| USB port of a hidraw node, e.g. "1-2.3", or an empty      |
+| string where it cannot be found.  hidraw nodes are        |
+| numbered in plug order, the port they hang off is not.    |
+\*---------------------------------------------------------*/
+static std::string MadCatzCyborgPortPath(const char* path)
 {
+#ifdef __linux__
+    const char* node = strrchr(path, '/');
+
+    if(node == nullptr || strncmp(node + 1, "hidraw", 6) != 0)
+    {
+        return("");
+    }
+
+    /*-----------------------------------------------------*\
+    | The device link resolves to                           |
+    | .../<bus>-<ports>:<config>.<interface>/<hid device>   |
+    \*-----------------------------------------------------*/
+    std::string link = std::string("/sys/class/hidraw/") + (node + 1) + "/device";
+    char        resolved[PATH_MAX];
+
+    if(realpath(link.c_str(), resolved) == nullptr)
+    {
+        return("");
+    }
+
+    std::string device_path = resolved;
+    std::size_t slash       = device_path.rfind('/');
+
+    if(slash == std::string::npos || slash == 0)
+    {
+        return("");
+    }
+
+    device_path.erase(slash);
+    slash = device_path.rfind('/');
+
+    std::string usb_interface = device_path.substr(slash + 1);
+    std::size_t colon         = usb_interface.find(':');
+
+    if(colon == std::string::npos || colon == 0)
+    {
+        return("");
+    }
+
+    return(usb_interface.substr(0, colon));
+#else
+    (void)path;
+
+    return("");
+#endif
+}
+
+std::mutex              MadCatzCyborgController::claimed_mutex;
+std::set<std::string>   MadCatzCyborgController::claimed_devices;
+
+MadCatzCyborgController::MadCatzCyborgController(hid_device* dev_handle, const char* path, const std::string& key)
+{
+    InitializeState();
+
     dev         = dev_handle;
     location    = path;
+    device_key  = key;
+}
+
+/*---------------------------------------------------------*\
+| Simulated device, every report goes to sim_transport      |
+| instead of hidapi.  Used by the load generator.           |
+\*---------------------------------------------------------*/
+MadCatzCyborgController::MadCatzCyborgController(const std::string& sim_name, cyborg_transport sim_transport)
+{
+    InitializeState();
+
+    location    = "Simulated: " + sim_name;
+    transport   = sim_transport;
+}
+
+void MadCatzCyborgController::InitializeState()
+{
+    dev         = nullptr;
+    transport   = nullptr;
+    state_entry = -1;
+
+    worker_thread      = nullptr;
+    worker_thread_run  = false;
+    schedule.reserve(MADCATZ_CYBORG_SCHEDULE_DEPTH);
+    report_latency_us    = 0;
+    deadline_on_time     = 0;
+    deadline_early       = 0;
+    deadline_late        = 0;
+    deadline_dropped     = 0;
+    deadline_superseded  = 0;
+    deadline_max_late_us = 0;
+    deadline_max_early_us = 0;
+    report_errors        = 0;
+
+    current_color[0]     = 0;
+    current_color[1]     = 0;
+    current_color[2]     = 0;
+    current_valid        = false;
+    idle_timeout_ms      = 0;
+    idle_color_enabled   = false;
+    idle_color[0]        = 0;
+    idle_color[1]        = 0;
+    idle_color[2]        = 0;
+    last_update          = std::chrono::steady_clock::now();
+    update_count         = 0;
+    idle                 = false;
+    idle_entries         = 0;
+    worker_wakeups       = 0;
+    idle_wakeups         = 0;
+
+    effect                = MADCATZ_CYBORG_EFFECT_NONE;
+    effect_period_ms      = 0;
+    effect_max_intensity  = 0;
+    effect_start          = std::chrono::steady_clock::now();
+    effect_last_intensity = -1;
 }
 
 MadCatzCyborgController::~MadCatzCyborgController()
 {
+    if(worker_thread != nullptr)
+    {
+        {
+            std::lock_guard<std::mutex> lock(worker_mutex);
+            worker_thread_run = false;
+        }
+
+        worker_cv.notify_all();
+        worker_thread->join();
+        delete worker_thread;
+        worker_thread = nullptr;
+    }
+
     if(dev != nullptr)
     {
         hid_close(dev);
         dev = nullptr;
     }
+
+    ReleaseDevice(device_key);
+}
+
+std::string MadCatzCyborgController::GetDeviceKey(hid_device_info* info)
+{
+    /*-----------------------------------------------------*\
+    | Prefer the serial number, it is the same for every    |
+    | interface and collection of one light                 |
+    \*-----------------------------------------------------*/
+    if(info->serial_number != nullptr && info->serial_number[0] != 0)
+    {
+        return("serial:" + StringUtils::wstring_to_string(info->serial_number));
+    }
+
+    /*-----------------------------------------------------*\
+    | Then the USB port, which survives a re-plug where the |
+    | hidraw node number does not                           |
+    \*-----------------------------------------------------*/
+    std::string port_path = MadCatzCyborgPortPath(info->path);
+
+    if(!port_path.empty())
+    {
+        return("port:" + port_path);
+    }
+
+    /*-----------------------------------------------------*\
+    | Otherwise fall back to the path                       |
+    \*-----------------------------------------------------*/
+    std::string path = info->path;
+
+    std::transform(path.begin(), path.end(), path.begin(), [](unsigned char c) { return((char)std::tolower(c)); });
+
+    return("path:" + path);
+}
+
+bool MadCatzCyborgController::ClaimDevice(const std::string& key)
+{
+    std::lock_guard<std::mutex> lock(claimed_mutex);
+
+    return(claimed_devices.insert(key).second);
+}
+
+void MadCatzCyborgController::ReleaseDevice(const std::string& key)
+{
+    std::lock_guard<std::mutex> lock(claimed_mutex);
+
+    claimed_devices.erase(key);
 }
 
 std::string MadCatzCyborgController::GetDeviceLocation()
@@ -33,6 +239,11 @@ std::string MadCatzCyborgController::GetDeviceLocation()
 
 std::string MadCatzCyborgController::GetSerialString()
 {
+    if(dev == nullptr)
+    {
+        return("");
+    }
+
     wchar_t serial_string[128];
     int ret = hid_get_serial_number_string(dev, serial_string, 128);
 
@@ -44,45 +255,575 @@ std::string MadCatzCyborgController::GetSerialString()
     return(StringUtils::wstring_to_string(serial_string));
 }
 
+std::string MadCatzCyborgController::GetStableKey()
+{
+    std::string key = GetSerialString();
+
+    /*-----------------------------------------------------*\
+    | Without a serial number use the detection key, which  |
+    | follows the USB port where it can be found            |
+    \*-----------------------------------------------------*/
+    if(key.empty())
+    {
+        key = device_key.empty() ? location : device_key;
+    }
+
+    return(key);
+}
+
+bool MadCatzCyborgController::IsOpen()
+{
+    return(dev != nullptr || transport);
+}
+
 void MadCatzCyborgController::Initialize()
 {
-    if(dev == nullptr)
+    if(!IsOpen())
     {
         return;
     }
 
     // Enable the device
-    unsigned char enable_buf[2] = { CMD_ENABLE, 0x00 };
-    hid_send_feature_report(dev, enable_buf, 2);
+    std::array<unsigned char, 2> enable_buf = enable_report;
+
+    std::lock_guard<std::mutex> lock(dev_mutex);
+    SendFeatureReport(enable_buf.data(), enable_buf.size());
+}
+
+bool MadCatzCyborgController::SendFeatureReport(const unsigned char* report, size_t size)
+{
+    /*-----------------------------------------------------*\
+    | Called with dev_mutex held                            |
+    \*-----------------------------------------------------*/
+    int result;
+
+    if(transport)
+    {
+        result = transport(report, size);
+    }
+    else
+    {
+        result = hid_send_feature_report(dev, report, size);
+    }
+
+    if(result < 0)
+    {
+        report_errors++;
+        return(false);
+    }
+
+    return(true);
+}
+
+cyborg_deadline_stats MadCatzCyborgController::GetDeadlineStats()
+{
+    cyborg_deadline_stats stats;
+
+    stats.sent_on_time      = deadline_on_time.load();
+    stats.sent_early        = deadline_early.load();
+    stats.sent_late         = deadline_late.load();
+    stats.dropped           = deadline_dropped.load();
+    stats.superseded        = deadline_superseded.load();
+    stats.max_late_us       = deadline_max_late_us.load();
+    stats.max_early_us      = deadline_max_early_us.load();
+    stats.report_latency_us = report_latency_us.load();
+    stats.report_errors     = report_errors.load();
+
+    return(stats);
+}
+
+void MadCatzCyborgController::SetIdleTimeout(unsigned int timeout_ms)
+{
+    {
+        std::lock_guard<std::mutex> lock(worker_mutex);
+
+        idle_timeout_ms = timeout_ms;
+
+        if(timeout_ms != 0)
+        {
+            StartWorkerThread();
+        }
+    }
+
+    worker_cv.notify_one();
+}
+
+void MadCatzCyborgController::SetIdleColor(bool enabled, unsigned char red, unsigned char green, unsigned char blue)
+{
+    std::lock_guard<std::mutex> lock(worker_mutex);
+
+    idle_color_enabled = enabled;
+    idle_color[0]      = red;
+    idle_color[1]      = green;
+    idle_color[2]      = blue;
+}
+
+cyborg_idle_stats MadCatzCyborgController::GetIdleStats()
+{
+    cyborg_idle_stats stats;
+
+    stats.idle           = idle.load();
+    stats.idle_entries   = idle_entries.load();
+    stats.worker_wakeups = worker_wakeups.load();
+    stats.idle_wakeups   = idle_wakeups.load();
+
+    return(stats);
+}
+
+void MadCatzCyborgController::EnableStateCache()
+{
+    state_entry = LightStateCache::Get()->Claim(GetStableKey());
+}
+
+bool MadCatzCyborgController::RestoreState(unsigned char* red, unsigned char* green, unsigned char* blue, unsigned char* intensity)
+{
+    int         entry = state_entry.load();
+    uint32_t    color;
+
+    if(!IsOpen() || entry < 0)
+    {
+        return(false);
+    }
+
+    if(!LightStateCache::Get()->LoadColor(entry, 0, &color)
+    || !LightStateCache::Get()->LoadIntensity(entry, intensity))
+    {
+        return(false);
+    }
+
+    *red   = color & 0xFF;
+    *green = (color >> 8) & 0xFF;
+    *blue  = (color >> 16) & 0xFF;
+
+    SetIntensity(*intensity);
+    SetLEDColor(*red, *green, *blue);
+
+    return(true);
+}
+
+void MadCatzCyborgController::StoreColorState(unsigned char red, unsigned char green, unsigned char blue)
+{
+    int entry = state_entry.load();
+
+    if(entry >= 0)
+    {
+        LightStateCache::Get()->StoreColor(entry, 0, red | (green << 8) | (blue << 16));
+    }
+}
+
+void MadCatzCyborgController::StartWorkerThread()
+{
+    /*-----------------------------------------------------*\
+    | Called with worker_mutex held                         |
+    \*-----------------------------------------------------*/
+    if(worker_thread == nullptr)
+    {
+        worker_thread_run = true;
+        worker_thread     = new std::thread(&MadCatzCyborgController::WorkerThreadFunction, this);
+    }
+}
+
+void MadCatzCyborgController::NoteUpdate()
+{
+    /*-----------------------------------------------------*\
+    | Called with worker_mutex held.  While active the      |
+    | worker picks up the new time when its idle timer      |
+    | runs out, it only needs waking when it is idle.       |
+    \*-----------------------------------------------------*/
+    last_update = std::chrono::steady_clock::now();
+    update_count++;
+
+    if(idle.load())
+    {
+        idle = false;
+        worker_cv.notify_one();
+    }
 }
 
 void MadCatzCyborgController::SetLEDColor(unsigned char red, unsigned char green, unsigned char blue)
 {
-    if(dev == nullptr)
+    if(!IsOpen())
     {
         return;
     }
-    
-    // Format: [CMD_COLOR][0x00][R][G][B][0x00][0x00][0x00][0x00]
-    unsigned char usb_buf[9] = 
-    { 
-        CMD_COLOR, 
-        0x00, 
-        red, 
-        green, 
-        blue, 
-        0x00, 
-        0x00, 
-        0x00, 
-        0x00 
-    };
-    
-    hid_send_feature_report(dev, usb_buf, 9);
+
+    FrameTraceSpan trace_span("MadCatzCyborgController::SetLEDColor");
+
+    std::unique_lock<std::mutex> lock(worker_mutex);
+    std::lock_guard<std::mutex>  dev_lock(dev_mutex);
+
+    /*-----------------------------------------------------*\
+    | Nothing to do if the light already shows this color,  |
+    | the idle timer keeps running                          |
+    \*-----------------------------------------------------*/
+    if(current_valid
+    && current_color[0] == red
+    && current_color[1] == green
+    && current_color[2] == blue)
+    {
+        return;
+    }
+
+    NoteUpdate();
+    lock.unlock();
+
+    SendColorReport(red, green, blue);
+    StoreColorState(red, green, blue);
+}
+
+void MadCatzCyborgController::SetLEDColorAt(unsigned char red, unsigned char green, unsigned char blue, std::chrono::steady_clock::time_point deadline)
+{
+    if(!IsOpen())
+    {
+        return;
+    }
+
+    cyborg_scheduled_color entry;
+
+    entry.color[0]    = red;
+    entry.color[1]    = green;
+    entry.color[2]    = blue;
+    entry.deadline    = deadline;
+    entry.trace_frame = FrameTrace::GetCurrentFrame();
+
+    {
+        std::lock_guard<std::mutex> lock(worker_mutex);
+
+        ScheduleColor(entry);
+        NoteUpdate();
+        StartWorkerThread();
+    }
+
+    worker_cv.notify_one();
+}
+
+void MadCatzCyborgController::ScheduleColor(const cyborg_scheduled_color& entry)
+{
+    /*-----------------------------------------------------*\
+    | Called with worker_mutex held                         |
+    \*-----------------------------------------------------*/
+    unsigned int entry_idx = 0;
+
+    while(entry_idx < schedule.size() && schedule[entry_idx].deadline < entry.deadline)
+    {
+        entry_idx++;
+    }
+
+    /*-----------------------------------------------------*\
+    | Same presentation time, the newer color wins          |
+    \*-----------------------------------------------------*/
+    if(entry_idx < schedule.size() && schedule[entry_idx].deadline == entry.deadline)
+    {
+        schedule[entry_idx] = entry;
+        deadline_superseded++;
+        return;
+    }
+
+    /*-----------------------------------------------------*\
+    | Full, give up whichever color is furthest out         |
+    \*-----------------------------------------------------*/
+    if(schedule.size() >= MADCATZ_CYBORG_SCHEDULE_DEPTH)
+    {
+        deadline_dropped++;
+
+        if(entry_idx == schedule.size())
+        {
+            return;
+        }
+
+        schedule.pop_back();
+    }
+
+    schedule.insert(schedule.begin() + entry_idx, entry);
+}
+
+void MadCatzCyborgController::SendColorReport(unsigned char red, unsigned char green, unsigned char blue)
+{
+    std::array<unsigned char, 9> usb_buf = color_report;
+
+    usb_buf[2] = red;
+    usb_buf[3] = green;
+    usb_buf[4] = blue;
+
+    current_color[0] = red;
+    current_color[1] = green;
+    current_color[2] = blue;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    {
+        FrameTraceSpan trace_span("hid_send_feature_report");
+
+        current_valid = SendFeatureReport(usb_buf.data(), usb_buf.size());
+    }
+
+    /*-----------------------------------------------------*\
+    | Keep a running average of the report time so that     |
+    | scheduled colors can be sent ahead of time            |
+    \*-----------------------------------------------------*/
+    unsigned int sample_us  = (unsigned int)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    unsigned int average_us = report_latency_us.load();
+
+    report_latency_us = (average_us == 0) ? sample_us : ((average_us * 7) + sample_us) / 8;
+}
+
+void MadCatzCyborgController::FadeToIdleColor()
+{
+    unsigned char       start[3];
+    unsigned char       target[3];
+    unsigned long long  start_count;
+
+    {
+        std::lock_guard<std::mutex> lock(worker_mutex);
+
+        target[0]   = idle_color[0];
+        target[1]   = idle_color[1];
+        target[2]   = idle_color[2];
+        start_count = update_count;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(dev_mutex);
+
+        start[0] = current_color[0];
+        start[1] = current_color[1];
+        start[2] = current_color[2];
+    }
+
+    for(unsigned int step = 1; step <= MADCATZ_CYBORG_IDLE_FADE_STEPS; step++)
+    {
+        unsigned char step_color[3];
+
+        for(unsigned int channel = 0; channel < 3; channel++)
+        {
+            step_color[channel] = (unsigned char)(start[channel] + (((int)target[channel] - (int)start[channel]) * (int)step) / MADCATZ_CYBORG_IDLE_FADE_STEPS);
+        }
+
+        /*-------------------------------------------------*\
+        | Give up as soon as a new update arrives, checked  |
+        | under the device lock so the fade can never       |
+        | overwrite it                                      |
+        \*-------------------------------------------------*/
+        {
+            std::unique_lock<std::mutex> lock(worker_mutex);
+
+            if(!worker_thread_run.load() || update_count != start_count)
+            {
+                return;
+            }
+
+            std::lock_guard<std::mutex> dev_lock(dev_mutex);
+            lock.unlock();
+
+            SendColorReport(step_color[0], step_color[1], step_color[2]);
+        }
+
+        std::unique_lock<std::mutex> lock(worker_mutex);
+
+        worker_cv.wait_for(lock, std::chrono::milliseconds(MADCATZ_CYBORG_IDLE_FADE_MS / MADCATZ_CYBORG_IDLE_FADE_STEPS), [this, start_count]
+        {
+            return(!worker_thread_run.load() || update_count != start_count);
+        });
+    }
+}
+
+std::chrono::steady_clock::time_point MadCatzCyborgController::RunEffect(std::unique_lock<std::mutex>& lock, std::chrono::steady_clock::time_point now)
+{
+    /*-----------------------------------------------------*\
+    | Called with worker_mutex held                         |
+    \*-----------------------------------------------------*/
+    unsigned int    elapsed_ms = (unsigned int)(std::chrono::duration_cast<std::chrono::milliseconds>(now - effect_start).count() % effect_period_ms);
+    float           phase      = (float)elapsed_ms / (float)effect_period_ms;
+    float           level;
+
+    if(effect == MADCATZ_CYBORG_EFFECT_BREATHING)
+    {
+        level = (1.0f - cosf(phase * 2.0f * 3.14159265f)) / 2.0f;
+    }
+    else
+    {
+        level = (phase < 0.5f) ? (1.0f - (phase * 2.0f)) : ((phase - 0.5f) * 2.0f);
+    }
+
+    int intensity = (int)(level * effect_max_intensity + 0.5f);
+
+    /*-----------------------------------------------------*\
+    | Only send when the level actually changed             |
+    \*-----------------------------------------------------*/
+    if(intensity != effect_last_intensity)
+    {
+        effect_last_intensity = intensity;
+
+        std::unique_lock<std::mutex> dev_lock(dev_mutex);
+        lock.unlock();
+
+        SendIntensityReport((unsigned char)intensity);
+
+        dev_lock.unlock();
+        lock.lock();
+    }
+
+    unsigned int tick_ms = (effect_max_intensity == 0) ? MADCATZ_CYBORG_EFFECT_TICK_MAX_MS : effect_period_ms / (2 * effect_max_intensity);
+
+    tick_ms = std::max<unsigned int>(MADCATZ_CYBORG_EFFECT_TICK_MIN_MS, std::min<unsigned int>(MADCATZ_CYBORG_EFFECT_TICK_MAX_MS, tick_ms));
+
+    return(now + std::chrono::milliseconds(tick_ms));
+}
+
+void MadCatzCyborgController::WorkerThreadFunction()
+{
+    std::unique_lock<std::mutex> lock(worker_mutex);
+
+    bool woke_up = false;
+
+    while(worker_thread_run.load())
+    {
+        std::chrono::steady_clock::time_point now       = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point wake_time = std::chrono::steady_clock::time_point::max();
+
+        if(!schedule.empty())
+        {
+            std::chrono::steady_clock::time_point send_time = schedule.front().deadline - std::chrono::microseconds(report_latency_us.load() + MADCATZ_CYBORG_SCHEDULE_SLACK_US);
+
+            if(send_time <= now)
+            {
+                woke_up = false;
+                SendScheduledColor(lock, now);
+                continue;
+            }
+
+            wake_time = send_time;
+        }
+
+        if(effect != MADCATZ_CYBORG_EFFECT_NONE)
+        {
+            std::chrono::steady_clock::time_point tick_time = RunEffect(lock, now);
+
+            if(tick_time < wake_time)
+            {
+                wake_time = tick_time;
+            }
+        }
+        else if(schedule.empty())
+        {
+            if(woke_up && idle.load())
+            {
+                idle_wakeups++;
+            }
+
+            /*---------------------------------------------*\
+            | Go idle once the quiet period is over,        |
+            | otherwise wake up when it will be             |
+            \*---------------------------------------------*/
+            if(!idle.load() && idle_timeout_ms != 0)
+            {
+                std::chrono::steady_clock::time_point idle_time = last_update + std::chrono::milliseconds(idle_timeout_ms);
+
+                if(now >= idle_time)
+                {
+                    idle = true;
+                    idle_entries++;
+
+                    if(idle_color_enabled)
+                    {
+                        lock.unlock();
+                        FadeToIdleColor();
+                        lock.lock();
+                    }
+
+                    woke_up = false;
+                    continue;
+                }
+
+                wake_time = idle_time;
+            }
+        }
+
+        if(wake_time == std::chrono::steady_clock::time_point::max())
+        {
+            worker_cv.wait(lock);
+        }
+        else
+        {
+            worker_cv.wait_until(lock, wake_time);
+        }
+
+        worker_wakeups++;
+        woke_up = true;
+    }
+}
+
+void MadCatzCyborgController::SendScheduledColor(std::unique_lock<std::mutex>& lock, std::chrono::steady_clock::time_point now)
+{
+    cyborg_scheduled_color entry = schedule.front();
+
+    schedule.erase(schedule.begin());
+
+    /*-----------------------------------------------------*\
+    | A color that can no longer arrive in time is dropped  |
+    | rather than shown late                                |
+    \*-----------------------------------------------------*/
+    if(now > entry.deadline)
+    {
+        deadline_dropped++;
+        return;
+    }
+
+    unsigned char                           red      = entry.color[0];
+    unsigned char                           green    = entry.color[1];
+    unsigned char                           blue     = entry.color[2];
+    std::chrono::steady_clock::time_point   deadline = entry.deadline;
+
+    FrameTrace::SetCurrentFrame(entry.trace_frame);
+
+    /*-----------------------------------------------------*\
+    | Take the device before letting go of the schedule so  |
+    | an immediate color queued meanwhile is always sent    |
+    | after this one                                        |
+    \*-----------------------------------------------------*/
+    std::unique_lock<std::mutex> dev_lock(dev_mutex);
+    lock.unlock();
+
+    SendColorReport(red, green, blue);
+    StoreColorState(red, green, blue);
+
+    dev_lock.unlock();
+
+    std::chrono::steady_clock::time_point done = std::chrono::steady_clock::now();
+
+    if(done > deadline)
+    {
+        unsigned int late_us = (unsigned int)std::chrono::duration_cast<std::chrono::microseconds>(done - deadline).count();
+
+        deadline_late++;
+
+        if(late_us > deadline_max_late_us.load())
+        {
+            deadline_max_late_us = late_us;
+        }
+    }
+    else if(done < deadline - std::chrono::microseconds(MADCATZ_CYBORG_DEADLINE_WINDOW_US))
+    {
+        unsigned int early_us = (unsigned int)std::chrono::duration_cast<std::chrono::microseconds>(deadline - done).count();
+
+        deadline_early++;
+
+        if(early_us > deadline_max_early_us.load())
+        {
+            deadline_max_early_us = early_us;
+        }
+    }
+    else
+    {
+        deadline_on_time++;
+    }
+
+    lock.lock();
 }
 
 void MadCatzCyborgController::SetIntensity(unsigned char intensity)
 {
-    if(dev == nullptr)
+    if(!IsOpen())
     {
         return;
     }
@@ -93,7 +834,57 @@ void MadCatzCyborgController::SetIntensity(unsigned char intensity)
         intensity = 100;
     }
     
-    // Format: [CMD_INTENSITY][0x00][intensity_value]
-    unsigned char usb_buf[3] = { CMD_INTENSITY, 0x00, intensity };
-    hid_send_feature_report(dev, usb_buf, 3);
+    {
+        std::lock_guard<std::mutex> lock(worker_mutex);
+        NoteUpdate();
+    }
+
+    std::lock_guard<std::mutex> lock(dev_mutex);
+
+    SendIntensityReport(intensity);
+
+    int entry = state_entry.load();
+
+    if(entry >= 0)
+    {
+        LightStateCache::Get()->StoreIntensity(entry, intensity);
+    }
+}
+
+void MadCatzCyborgController::SetEffect(unsigned char new_effect, unsigned int period_ms, unsigned char max_intensity)
+{
+    if(!IsOpen())
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(worker_mutex);
+
+        effect                = new_effect;
+        effect_period_ms      = (period_ms == 0) ? 1 : period_ms;
+        effect_max_intensity  = (max_intensity > 100) ? 100 : max_intensity;
+        effect_start          = std::chrono::steady_clock::now();
+        effect_last_intensity = -1;
+
+        NoteUpdate();
+
+        if(effect != MADCATZ_CYBORG_EFFECT_NONE)
+        {
+            StartWorkerThread();
+        }
+    }
+
+    worker_cv.notify_one();
+}
+
+void MadCatzCyborgController::SendIntensityReport(unsigned char intensity)
+{
+    std::array<unsigned char, 3> usb_buf = intensity_report;
+
+    usb_buf[2] = intensity;
+
+    FrameTraceSpan trace_span("hid_send_feature_report");
+
+    SendFeatureReport(usb_buf.data(), usb_buf.size());
 }
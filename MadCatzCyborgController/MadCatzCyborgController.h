@@ -9,26 +9,266 @@
 
 #pragma once
 
+#include "RGBController.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
+#include <vector>
 #include <hidapi.h>
 
+#define MADCATZ_CYBORG_ZONE_COUNT           1
+#define MADCATZ_CYBORG_LED_COUNT            1
+
+/*---------------------------------------------------------*\
+| Device description, zone setup is generated from these    |
+| tables                                                    |
+\*---------------------------------------------------------*/
+typedef struct
+{
+    const char*     name;
+    unsigned int    zone;
+} cyborg_led_descriptor;
+
+typedef struct
+{
+    const char*     name;
+    zone_type       type;
+    unsigned int    start_idx;
+    unsigned int    leds_count;
+} cyborg_zone_descriptor;
+
+static constexpr cyborg_zone_descriptor cyborg_zones[MADCATZ_CYBORG_ZONE_COUNT] =
+{
+    { "Cyborg",         ZONE_TYPE_SINGLE,   0,  1   },
+};
+
+static constexpr cyborg_led_descriptor cyborg_leds[MADCATZ_CYBORG_LED_COUNT] =
+{
+    { "LED",            0   },
+};
+
+constexpr bool MadCatzCyborgDescriptorValid()
+{
+    unsigned int next_start = 0;
+
+    for(unsigned int zone_idx = 0; zone_idx < MADCATZ_CYBORG_ZONE_COUNT; zone_idx++)
+    {
+        if(cyborg_zones[zone_idx].start_idx != next_start)
+        {
+            return(false);
+        }
+
+        next_start += cyborg_zones[zone_idx].leds_count;
+    }
+
+    if(next_start != MADCATZ_CYBORG_LED_COUNT)
+    {
+        return(false);
+    }
+
+    for(unsigned int led_idx = 0; led_idx < MADCATZ_CYBORG_LED_COUNT; led_idx++)
+    {
+        if(cyborg_leds[led_idx].zone >= MADCATZ_CYBORG_ZONE_COUNT)
+        {
+            return(false);
+        }
+
+        const cyborg_zone_descriptor& led_zone = cyborg_zones[cyborg_leds[led_idx].zone];
+
+        if(led_idx < led_zone.start_idx || led_idx >= led_zone.start_idx + led_zone.leds_count)
+        {
+            return(false);
+        }
+    }
+
+    return(true);
+}
+
+static_assert(MadCatzCyborgDescriptorValid(), "Cyborg zones must cover every LED once, in order");
+
+/*---------------------------------------------------------*\
+| Scheduled colors that can wait for their presentation     |
+| time at once, enough for a producer a few frames ahead    |
+\*---------------------------------------------------------*/
+#define MADCATZ_CYBORG_SCHEDULE_DEPTH       16
+
+/*---------------------------------------------------------*\
+| Counters for colors queued with a presentation deadline.  |
+| Early colors landed more than 1 ms ahead of their         |
+| deadline.  Superseded colors were replaced by a newer     |
+| color for the same presentation time.                     |
+\*---------------------------------------------------------*/
+typedef struct
+{
+    unsigned long long  sent_on_time;
+    unsigned long long  sent_early;
+    unsigned long long  sent_late;
+    unsigned long long  dropped;
+    unsigned long long  superseded;
+    unsigned int        max_early_us;
+    unsigned int        max_late_us;
+    unsigned int        report_latency_us;
+    unsigned long long  report_errors;
+} cyborg_deadline_stats;
+
+/*---------------------------------------------------------*\
+| Power save counters.  While idle the worker thread only   |
+| wakes up for new work, so idle_wakeups stays at zero      |
+| unless something woke it without work to do.              |
+\*---------------------------------------------------------*/
+typedef struct
+{
+    bool                idle;
+    unsigned long long  idle_entries;
+    unsigned long long  worker_wakeups;
+    unsigned long long  idle_wakeups;
+} cyborg_idle_stats;
+
+typedef struct
+{
+    unsigned char                           color[3];
+    std::chrono::steady_clock::time_point   deadline;
+    uint64_t                                trace_frame;
+} cyborg_scheduled_color;
+
+/*---------------------------------------------------------*\
+| Intensity effects run by the worker thread.  They only    |
+| send the 3-byte intensity report, the color is left as    |
+| set by the last color report.                             |
+\*---------------------------------------------------------*/
+enum
+{
+    MADCATZ_CYBORG_EFFECT_NONE      = 0,
+    MADCATZ_CYBORG_EFFECT_BREATHING = 1,
+    MADCATZ_CYBORG_EFFECT_FADE      = 2
+};
+
+/*---------------------------------------------------------*\
+| Report sink used in place of hidapi for simulated         |
+| devices.  Returns the number of bytes written or -1.      |
+\*---------------------------------------------------------*/
+typedef std::function<int(const unsigned char* report, size_t size)> cyborg_transport;
+
 class MadCatzCyborgController
 {
 public:
-    MadCatzCyborgController(hid_device* dev_handle, const char* path);
+    MadCatzCyborgController(hid_device* dev_handle, const char* path, const std::string& key);
+    MadCatzCyborgController(const std::string& sim_name, cyborg_transport sim_transport);
     ~MadCatzCyborgController();
 
+    static std::string  GetDeviceKey(hid_device_info* info);
+    static bool         ClaimDevice(const std::string& key);
+    static void         ReleaseDevice(const std::string& key);
+
     std::string     GetDeviceLocation();
     std::string     GetSerialString();
+    std::string     GetStableKey();
 
     void            Initialize();
     void            SetLEDColor(unsigned char red, unsigned char green, unsigned char blue);
+    void            SetLEDColorAt(unsigned char red, unsigned char green, unsigned char blue, std::chrono::steady_clock::time_point deadline);
     void            SetIntensity(unsigned char intensity);
+    void            SetEffect(unsigned char effect, unsigned int period_ms, unsigned char max_intensity);
+
+    cyborg_deadline_stats GetDeadlineStats();
+
+    void            SetIdleTimeout(unsigned int timeout_ms);
+    void            SetIdleColor(bool enabled, unsigned char red, unsigned char green, unsigned char blue);
+    cyborg_idle_stats GetIdleStats();
+
+    void            EnableStateCache();
+    bool            RestoreState(unsigned char* red, unsigned char* green, unsigned char* blue, unsigned char* intensity);
 
 private:
     hid_device*     dev;
+    cyborg_transport transport;
     std::string     location;
-    
+    std::string     device_key;
+    std::mutex      dev_mutex;
+
+    /*-----------------------------------------------------*\
+    | Last frame cache entry, -1 while caching is disabled  |
+    \*-----------------------------------------------------*/
+    std::atomic<int> state_entry;
+
+    /*-----------------------------------------------------*\
+    | Devices that already have a controller, so that each  |
+    | light is only opened once across interfaces, HID      |
+    | collections and rescans                               |
+    \*-----------------------------------------------------*/
+    static std::mutex               claimed_mutex;
+    static std::set<std::string>    claimed_devices;
+
+    /*-----------------------------------------------------*\
+    | The worker thread sends scheduled colors and tracks   |
+    | idle time.  It is only started once a color is        |
+    | scheduled or an idle timeout is set.  Scheduled       |
+    | colors wait in the schedule in deadline order.        |
+    \*-----------------------------------------------------*/
+    std::thread*                            worker_thread;
+    std::atomic<bool>                       worker_thread_run;
+    std::mutex                              worker_mutex;
+    std::condition_variable                 worker_cv;
+    std::vector<cyborg_scheduled_color>     schedule;
+    std::atomic<unsigned int>               report_latency_us;
+    std::atomic<unsigned long long>         deadline_on_time;
+    std::atomic<unsigned long long>         deadline_early;
+    std::atomic<unsigned long long>         deadline_late;
+    std::atomic<unsigned long long>         deadline_dropped;
+    std::atomic<unsigned long long>         deadline_superseded;
+    std::atomic<unsigned int>               deadline_max_early_us;
+    std::atomic<unsigned int>               deadline_max_late_us;
+    std::atomic<unsigned long long>         report_errors;
+
+    /*-----------------------------------------------------*\
+    | Power save.  After idle_timeout_ms without an update  |
+    | the worker thread optionally fades to the idle color  |
+    | once and then sleeps until the next update.  A        |
+    | timeout of 0 disables idle tracking.  current_color   |
+    | is the last color sent, guarded by dev_mutex.         |
+    \*-----------------------------------------------------*/
+    unsigned char                           current_color[3];
+    bool                                    current_valid;
+    unsigned int                            idle_timeout_ms;
+    bool                                    idle_color_enabled;
+    unsigned char                           idle_color[3];
+    std::chrono::steady_clock::time_point   last_update;
+    unsigned long long                      update_count;
+    std::atomic<bool>                       idle;
+    std::atomic<unsigned long long>         idle_entries;
+    std::atomic<unsigned long long>         worker_wakeups;
+    std::atomic<unsigned long long>         idle_wakeups;
+
+    /*-----------------------------------------------------*\
+    | Intensity effect, guarded by worker_mutex             |
+    \*-----------------------------------------------------*/
+    unsigned char                           effect;
+    unsigned int                            effect_period_ms;
+    unsigned char                           effect_max_intensity;
+    std::chrono::steady_clock::time_point   effect_start;
+    int                                     effect_last_intensity;
+
+    void            InitializeState();
+    bool            IsOpen();
+    bool            SendFeatureReport(const unsigned char* report, size_t size);
+    void            FadeToIdleColor();
+    void            NoteUpdate();
+    void            StartWorkerThread();
+    std::chrono::steady_clock::time_point RunEffect(std::unique_lock<std::mutex>& lock, std::chrono::steady_clock::time_point now);
+    void            SendColorReport(unsigned char red, unsigned char green, unsigned char blue);
+    void            SendIntensityReport(unsigned char intensity);
+    void            StoreColorState(unsigned char red, unsigned char green, unsigned char blue);
+    void            ScheduleColor(const cyborg_scheduled_color& entry);
+    void            SendScheduledColor(std::unique_lock<std::mutex>& lock, std::chrono::steady_clock::time_point now);
+    void            WorkerThreadFunction();
+
     // Protocol constants
     enum Commands
     {
@@ -36,4 +276,15 @@ private:
         CMD_COLOR     = 0xA2,
         CMD_INTENSITY = 0xA6
     };
+
+    /*-----------------------------------------------------*\
+    | Report templates, only the value bytes are filled in  |
+    | at send time                                          |
+    |   Enable:    [CMD_ENABLE][0x00]                       |
+    |   Color:     [CMD_COLOR][0x00][R][G][B][0x00 x4]      |
+    |   Intensity: [CMD_INTENSITY][0x00][0-100]             |
+    \*-----------------------------------------------------*/
+    static constexpr std::array<unsigned char, 2> enable_report    = { CMD_ENABLE,    0x00 };
+    static constexpr std::array<unsigned char, 9> color_report     = { CMD_COLOR,     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    static constexpr std::array<unsigned char, 3> intensity_report = { CMD_INTENSITY, 0x00, 0x00 };
 };
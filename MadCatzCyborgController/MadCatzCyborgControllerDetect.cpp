@@ -8,6 +8,7 @@
 \*---------------------------------------------------------*/
 
 #include "Detector.h"
+#include "LogManager.h"
 #include "MadCatzCyborgController.h"
 #include "RGBController.h"
 #include "RGBController_MadCatzCyborg.h"
@@ -19,6 +20,13 @@
 #define MADCATZ_VID        0x06A3
 #define MADCATZ_CYBORG_PID 0x0DC5
 
+/*-----------------------------------------------------*\
+| The light is driven through interface 0.  Where that  |
+| interface is listed once per collection, the claim    |
+| registry opens only the first one.                    |
+\*-----------------------------------------------------*/
+#define MADCATZ_CYBORG_INTERFACE  0
+
 /******************************************************************************************\
 *                                                                                          *
 *   DetectMadCatzCyborgControllers                                                         *
@@ -29,17 +37,32 @@
 
 void DetectMadCatzCyborgControllers(hid_device_info* info, const std::string& /*name*/)
 {
+    /*-----------------------------------------------------*\
+    | Skip lights that already have a controller           |
+    \*-----------------------------------------------------*/
+    std::string device_key = MadCatzCyborgController::GetDeviceKey(info);
+
+    if(!MadCatzCyborgController::ClaimDevice(device_key))
+    {
+        LOG_DEBUG("[MadCatz Cyborg] Skipping %s, already claimed as %s", info->path, device_key.c_str());
+        return;
+    }
+
     hid_device* dev = hid_open_path(info->path);
     
     if(dev)
     {
-        MadCatzCyborgController* controller = new MadCatzCyborgController(dev, info->path);
+        MadCatzCyborgController* controller = new MadCatzCyborgController(dev, info->path, device_key);
         controller->Initialize();
         
         RGBController_MadCatzCyborg* rgb_controller = new RGBController_MadCatzCyborg(controller);
         
         ResourceManager::get()->RegisterRGBController(rgb_controller);
     }
+    else
+    {
+        MadCatzCyborgController::ReleaseDevice(device_key);
+    }
 }
 
-REGISTER_HID_DETECTOR("MadCatz Cyborg Gaming Light", DetectMadCatzCyborgControllers, MADCATZ_VID, MADCATZ_CYBORG_PID);
+REGISTER_HID_DETECTOR_I("MadCatz Cyborg Gaming Light", DetectMadCatzCyborgControllers, MADCATZ_VID, MADCATZ_CYBORG_PID, MADCATZ_CYBORG_INTERFACE);
@@ -8,6 +8,9 @@
 \*---------------------------------------------------------*/
 
 #include "RGBController_MadCatzCyborg.h"
+#include "FrameTrace.h"
+#include "ResourceManager.h"
+#include "SettingsManager.h"
 
 /**--------------------------------------------------------*\
     @name MadCatz Cyborg Gaming Light
@@ -15,12 +18,12 @@
     @type USB
     @save :x:
     @direct :white_check_mark:
-    @effects :x:
+    @effects :white_check_mark:
     @detectors DetectMadCatzCyborgControllers
     @comment The MadCatz Cyborg Gaming Light is an ambient lighting device.
 \*---------------------------------------------------------*/
 
-RGBController_MadCatzCyborg::RGBController_MadCatzCyborg(MadCatzCyborgController* controller_ptr)
+RGBController_MadCatzCyborg::RGBController_MadCatzCyborg(MadCatzCyborgController* controller_ptr, bool load_settings)
 {
     controller  = controller_ptr;
     
@@ -40,33 +43,156 @@ RGBController_MadCatzCyborg::RGBController_MadCatzCyborg(MadCatzCyborgController
     Direct.brightness_max = 100;
     Direct.brightness     = 100;
     modes.push_back(Direct);
+
+    /*-----------------------------------------------------*\
+    | Breathing and Fade run on the controller's worker     |
+    | thread and only send the intensity report per step    |
+    \*-----------------------------------------------------*/
+    mode Breathing;
+    Breathing.name           = "Breathing";
+    Breathing.value          = MADCATZ_CYBORG_EFFECT_BREATHING;
+    Breathing.flags          = MODE_FLAG_HAS_MODE_SPECIFIC_COLOR | MODE_FLAG_HAS_SPEED | MODE_FLAG_HAS_BRIGHTNESS;
+    Breathing.color_mode     = MODE_COLORS_MODE_SPECIFIC;
+    Breathing.colors_min     = 1;
+    Breathing.colors_max     = 1;
+    Breathing.colors.resize(1);
+    Breathing.colors[0]      = ToRGBColor(255, 255, 255);
+    Breathing.speed_min      = MADCATZ_CYBORG_SPEED_MIN;
+    Breathing.speed_max      = MADCATZ_CYBORG_SPEED_MAX;
+    Breathing.speed          = MADCATZ_CYBORG_SPEED_DEFAULT;
+    Breathing.brightness_min = 0;
+    Breathing.brightness_max = 100;
+    Breathing.brightness     = 100;
+    modes.push_back(Breathing);
+
+    mode Fade;
+    Fade.name                = "Fade";
+    Fade.value               = MADCATZ_CYBORG_EFFECT_FADE;
+    Fade.flags               = MODE_FLAG_HAS_MODE_SPECIFIC_COLOR | MODE_FLAG_HAS_SPEED | MODE_FLAG_HAS_BRIGHTNESS;
+    Fade.color_mode          = MODE_COLORS_MODE_SPECIFIC;
+    Fade.colors_min          = 1;
+    Fade.colors_max          = 1;
+    Fade.colors.resize(1);
+    Fade.colors[0]           = ToRGBColor(255, 255, 255);
+    Fade.speed_min           = MADCATZ_CYBORG_SPEED_MIN;
+    Fade.speed_max           = MADCATZ_CYBORG_SPEED_MAX;
+    Fade.speed               = MADCATZ_CYBORG_SPEED_DEFAULT;
+    Fade.brightness_min      = 0;
+    Fade.brightness_max      = 100;
+    Fade.brightness          = 100;
+    modes.push_back(Fade);
+
+    effect_active = false;
+    effect_color  = 0;
     
     SetupZones();
+
+    /*-----------------------------------------------------*\
+    | Without settings there is no idle timer, no restored  |
+    | color and no frame ring, as the load generator needs  |
+    \*-----------------------------------------------------*/
+    frame_ring = nullptr;
+
+    if(load_settings)
+    {
+        LoadSettings();
+    }
     
     controller->SetIntensity(modes[active_mode].brightness);
 }
 
 RGBController_MadCatzCyborg::~RGBController_MadCatzCyborg()
 {
+    delete frame_ring;
     delete controller;
 }
 
+void RGBController_MadCatzCyborg::LoadSettings()
+{
+    FrameTrace::LoadSettings();
+
+    /*-----------------------------------------------------*\
+    | Power save settings, idle_color is an RRGGBB string   |
+    \*-----------------------------------------------------*/
+    json cyborg_settings = ResourceManager::get()->GetSettingsManager()->GetSettings("MadCatzCyborgSettings");
+
+    try
+    {
+        if(cyborg_settings.contains("idle_color"))
+        {
+            unsigned int idle_rgb = std::stoul(cyborg_settings["idle_color"].get<std::string>(), nullptr, 16);
+            controller->SetIdleColor(true, (idle_rgb >> 16) & 0xFF, (idle_rgb >> 8) & 0xFF, idle_rgb & 0xFF);
+        }
+
+        if(cyborg_settings.contains("idle_timeout_ms"))
+        {
+            controller->SetIdleTimeout(cyborg_settings["idle_timeout_ms"].get<unsigned int>());
+        }
+    }
+    catch(...)
+    {
+    }
+
+    /*-----------------------------------------------------*\
+    | Put the last color and brightness back up straight    |
+    | away instead of waiting for a profile                 |
+    \*-----------------------------------------------------*/
+    try
+    {
+        if(cyborg_settings.contains("restore_last_frame") && cyborg_settings["restore_last_frame"].get<bool>())
+        {
+            unsigned char red;
+            unsigned char green;
+            unsigned char blue;
+            unsigned char intensity;
+
+            controller->EnableStateCache();
+
+            if(controller->RestoreState(&red, &green, &blue, &intensity))
+            {
+                colors[0]            = ToRGBColor(red, green, blue);
+                modes[0].brightness  = intensity;
+            }
+        }
+    }
+    catch(...)
+    {
+    }
+
+    /*-----------------------------------------------------*\
+    | Optionally read frames straight from a local producer |
+    \*-----------------------------------------------------*/
+    if(SharedFrameRing::IsEnabled())
+    {
+        frame_ring = new SharedFrameRing(controller->GetStableKey(), [this](const RGBColor* ring_colors, unsigned int count, std::chrono::steady_clock::time_point present_time)
+        {
+            ConsumeSharedFrame(ring_colors, count, present_time);
+        });
+    }
+}
+
 void RGBController_MadCatzCyborg::SetupZones()
 {
-    zone cyborg_zone;
-    
-    cyborg_zone.name       = "Cyborg";
-    cyborg_zone.type       = ZONE_TYPE_SINGLE;
-    cyborg_zone.leds_min   = 1;
-    cyborg_zone.leds_max   = 1;
-    cyborg_zone.leds_count = 1;
-    cyborg_zone.matrix_map = NULL;
-    
-    zones.push_back(cyborg_zone);
-    
-    led cyborg_led;
-    cyborg_led.name = "LED";
-    leds.push_back(cyborg_led);
+    for(unsigned int zone_idx = 0; zone_idx < MADCATZ_CYBORG_ZONE_COUNT; zone_idx++)
+    {
+        zone cyborg_zone;
+
+        cyborg_zone.name       = cyborg_zones[zone_idx].name;
+        cyborg_zone.type       = cyborg_zones[zone_idx].type;
+        cyborg_zone.leds_min   = cyborg_zones[zone_idx].leds_count;
+        cyborg_zone.leds_max   = cyborg_zones[zone_idx].leds_count;
+        cyborg_zone.leds_count = cyborg_zones[zone_idx].leds_count;
+        cyborg_zone.matrix_map = NULL;
+
+        zones.push_back(cyborg_zone);
+    }
+
+    for(unsigned int led_idx = 0; led_idx < MADCATZ_CYBORG_LED_COUNT; led_idx++)
+    {
+        led cyborg_led;
+        cyborg_led.name = cyborg_leds[led_idx].name;
+        leds.push_back(cyborg_led);
+    }
     
     SetupColors();
 }
@@ -78,6 +204,17 @@ void RGBController_MadCatzCyborg::ResizeZone(int /*zone*/, int /*new_size*/)
 
 void RGBController_MadCatzCyborg::DeviceUpdateLEDs()
 {
+    FrameTrace::BeginFrame();
+    FrameTraceSpan trace_span("RGBController_MadCatzCyborg::DeviceUpdateLEDs");
+
+    /*-----------------------------------------------------*\
+    | Effect modes take their color from the mode instead   |
+    \*-----------------------------------------------------*/
+    if(modes[active_mode].value != 0)
+    {
+        return;
+    }
+
     if(colors.size() > 0)
     {
         RGBColor color = colors[0];
@@ -95,11 +232,106 @@ void RGBController_MadCatzCyborg::UpdateSingleLED(int /*led*/)
     DeviceUpdateLEDs();
 }
 
+void RGBController_MadCatzCyborg::UpdateLEDsAt(std::chrono::steady_clock::time_point present_time)
+{
+    FrameTrace::BeginFrame();
+    FrameTraceSpan trace_span("RGBController_MadCatzCyborg::UpdateLEDsAt");
+
+    if(modes[active_mode].value != 0)
+    {
+        return;
+    }
+
+    if(colors.size() > 0)
+    {
+        RGBColor color = colors[0];
+        controller->SetLEDColorAt(RGBGetRValue(color), RGBGetGValue(color), RGBGetBValue(color), present_time);
+    }
+}
+
+void RGBController_MadCatzCyborg::ConsumeSharedFrame(const RGBColor* ring_colors, unsigned int count, std::chrono::steady_clock::time_point present_time)
+{
+    FrameTrace::BeginFrame();
+    FrameTraceSpan trace_span("RGBController_MadCatzCyborg::ConsumeSharedFrame");
+
+    /*-----------------------------------------------------*\
+    | Effect modes own the color, ring frames wait for      |
+    | Direct mode like any other update                     |
+    \*-----------------------------------------------------*/
+    if(count == 0 || modes[active_mode].value != 0)
+    {
+        return;
+    }
+
+    RGBColor color = ring_colors[0];
+
+    if(present_time == std::chrono::steady_clock::time_point())
+    {
+        controller->SetLEDColor(RGBGetRValue(color), RGBGetGValue(color), RGBGetBValue(color));
+    }
+    else
+    {
+        controller->SetLEDColorAt(RGBGetRValue(color), RGBGetGValue(color), RGBGetBValue(color), present_time);
+    }
+}
+
+cyborg_deadline_stats RGBController_MadCatzCyborg::GetDeadlineStats()
+{
+    return(controller->GetDeadlineStats());
+}
+
 void RGBController_MadCatzCyborg::DeviceUpdateMode()
 {
-    if(modes[active_mode].flags & MODE_FLAG_HAS_BRIGHTNESS)
+    mode& current_mode = modes[active_mode];
+
+    if(current_mode.value != 0)
+    {
+        /*-------------------------------------------------*\
+        | Only resend the color when it changed, the effect |
+        | itself never touches the color report             |
+        \*-------------------------------------------------*/
+        RGBColor color = current_mode.colors.empty() ? 0 : current_mode.colors[0];
+
+        if(!effect_active || color != effect_color)
+        {
+            controller->SetLEDColor(RGBGetRValue(color), RGBGetGValue(color), RGBGetBValue(color));
+            effect_color = color;
+        }
+
+        effect_active = true;
+
+        /*-------------------------------------------------*\
+        | The speed comes straight from the client, keep it |
+        | in range before it divides the effect period      |
+        \*-------------------------------------------------*/
+        if(current_mode.speed < current_mode.speed_min)
+        {
+            current_mode.speed = current_mode.speed_min;
+        }
+
+        if(current_mode.speed > current_mode.speed_max)
+        {
+            current_mode.speed = current_mode.speed_max;
+        }
+
+        controller->SetEffect(current_mode.value, MADCATZ_CYBORG_SPEED_PERIOD_MS / current_mode.speed, current_mode.brightness);
+        return;
+    }
+
+    controller->SetEffect(MADCATZ_CYBORG_EFFECT_NONE, 0, 0);
+
+    if(current_mode.flags & MODE_FLAG_HAS_BRIGHTNESS)
+    {
+        controller->SetIntensity(current_mode.brightness);
+    }
+
+    /*-----------------------------------------------------*\
+    | Put the Direct color back after an effect             |
+    \*-----------------------------------------------------*/
+    if(effect_active)
     {
-        controller->SetIntensity(modes[active_mode].brightness);
+        effect_active = false;
+        DeviceUpdateLEDs();
     }
 }
 
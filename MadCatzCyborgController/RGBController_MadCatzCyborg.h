@@ -11,11 +11,20 @@
 
 #include "RGBController.h"
 #include "MadCatzCyborgController.h"
+#include "SharedFrameRing.h"
+
+/*---------------------------------------------------------*\
+| Effect speed, the period is SPEED_PERIOD_MS / speed       |
+\*---------------------------------------------------------*/
+#define MADCATZ_CYBORG_SPEED_MIN            1
+#define MADCATZ_CYBORG_SPEED_MAX            10
+#define MADCATZ_CYBORG_SPEED_DEFAULT        4
+#define MADCATZ_CYBORG_SPEED_PERIOD_MS      10000
 
 class RGBController_MadCatzCyborg : public RGBController
 {
 public:
-    RGBController_MadCatzCyborg(MadCatzCyborgController* controller_ptr);
+    RGBController_MadCatzCyborg(MadCatzCyborgController* controller_ptr, bool load_settings = true);
     ~RGBController_MadCatzCyborg();
 
     void        SetupZones();
@@ -24,10 +33,19 @@ public:
     void        DeviceUpdateLEDs();
     void        UpdateZoneLEDs(int zone);
     void        UpdateSingleLED(int led);
+    void        UpdateLEDsAt(std::chrono::steady_clock::time_point present_time);
     
     void        DeviceUpdateMode();
     void        SetCustomMode();
 
+    cyborg_deadline_stats GetDeadlineStats();
+
 private:
-    MadCatzCyborgController* controller;
+    MadCatzCyborgController*    controller;
+    SharedFrameRing*            frame_ring;
+    bool                        effect_active;
+    RGBColor                    effect_color;
+
+    void        LoadSettings();
+    void        ConsumeSharedFrame(const RGBColor* ring_colors, unsigned int count, std::chrono::steady_clock::time_point present_time);
 };
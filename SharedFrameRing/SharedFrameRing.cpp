@@ -0,0 +1,311 @@
+/*---------------------------------------------------------*\
+| SharedFrameRing.cpp                                       |
+|                                                           |
+|   Shared memory frame ring for local frame producers      |
+|                                                           |
+|   This file is part of the OpenRGB project                |
+|   SPDX-License-Identifier: GPL-2.0-only                   |
+\*---------------------------------------------------------*/
+
+#include "SharedFrameRing.h"
+#include "LogManager.h"
+#include "ResourceManager.h"
+#include "SettingsManager.h"
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+SharedFrameRing::SharedFrameRing(const std::string& key, SharedFrameCallback callback)
+{
+    frame_callback   = callback;
+    ring             = nullptr;
+    read_index       = 0;
+    mapping_handle   = nullptr;
+    semaphore_handle = nullptr;
+    ring_thread      = nullptr;
+    ring_thread_run  = false;
+
+    name = "OpenRGB_FrameRing_";
+
+    for(std::size_t char_idx = 0; char_idx < key.size(); char_idx++)
+    {
+        char c = key[char_idx];
+
+        if((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9'))
+        {
+            name += c;
+        }
+        else
+        {
+            name += '_';
+        }
+    }
+
+#ifdef _WIN32
+    std::string mapping_name   = "Local\\" + name;
+    std::string semaphore_name = "Local\\" + name + "_sem";
+
+    HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(shared_frame_ring), mapping_name.c_str());
+
+    if(mapping == NULL)
+    {
+        LOG_WARNING("[SharedFrameRing] Unable to create mapping %s", mapping_name.c_str());
+        return;
+    }
+
+    void* view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(shared_frame_ring));
+
+    if(view == NULL)
+    {
+        CloseHandle(mapping);
+        return;
+    }
+
+    HANDLE semaphore = CreateSemaphoreA(NULL, 0, LONG_MAX, semaphore_name.c_str());
+
+    if(semaphore == NULL)
+    {
+        UnmapViewOfFile(view);
+        CloseHandle(mapping);
+        return;
+    }
+
+    mapping_handle   = mapping;
+    semaphore_handle = semaphore;
+#else
+    std::string mapping_name   = "/" + name;
+    std::string semaphore_name = "/" + name + "_sem";
+
+    int fd = shm_open(mapping_name.c_str(), O_CREAT | O_RDWR, 0600);
+
+    if(fd < 0)
+    {
+        LOG_WARNING("[SharedFrameRing] Unable to create mapping %s", mapping_name.c_str());
+        return;
+    }
+
+    if(ftruncate(fd, sizeof(shared_frame_ring)) != 0)
+    {
+        close(fd);
+        return;
+    }
+
+    void* view = mmap(NULL, sizeof(shared_frame_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if(view == MAP_FAILED)
+    {
+        return;
+    }
+
+    sem_t* semaphore = sem_open(semaphore_name.c_str(), O_CREAT, 0600, 0);
+
+    if(semaphore == SEM_FAILED)
+    {
+        munmap(view, sizeof(shared_frame_ring));
+        return;
+    }
+
+    semaphore_handle = semaphore;
+#endif
+
+    ring = static_cast<shared_frame_ring*>(view);
+
+    /*-----------------------------------------------------*\
+    | Set up the header unless a producer left a valid ring |
+    | behind, in which case only new frames are read        |
+    \*-----------------------------------------------------*/
+    if(ring->magic != SHARED_FRAME_RING_MAGIC
+    || ring->version != SHARED_FRAME_RING_VERSION
+    || ring->slot_count != SHARED_FRAME_RING_SLOTS
+    || ring->max_leds != SHARED_FRAME_RING_MAX_LEDS)
+    {
+        memset(static_cast<void*>(ring), 0, sizeof(shared_frame_ring));
+
+        ring->version    = SHARED_FRAME_RING_VERSION;
+        ring->slot_count = SHARED_FRAME_RING_SLOTS;
+        ring->max_leds   = SHARED_FRAME_RING_MAX_LEDS;
+
+        std::atomic_thread_fence(std::memory_order_release);
+        ring->magic      = SHARED_FRAME_RING_MAGIC;
+    }
+
+    read_index = ring->write_index.load(std::memory_order_acquire);
+
+    ring_thread_run = true;
+    ring_thread     = new std::thread(&SharedFrameRing::RingThreadFunction, this);
+
+    LOG_INFO("[SharedFrameRing] Reading frames from %s", name.c_str());
+}
+
+SharedFrameRing::~SharedFrameRing()
+{
+    if(ring_thread != nullptr)
+    {
+        ring_thread_run = false;
+        PostFrame();
+        ring_thread->join();
+        delete ring_thread;
+        ring_thread = nullptr;
+    }
+
+#ifdef _WIN32
+    if(ring != nullptr)
+    {
+        UnmapViewOfFile(ring);
+    }
+
+    if(semaphore_handle != nullptr)
+    {
+        CloseHandle(static_cast<HANDLE>(semaphore_handle));
+    }
+
+    if(mapping_handle != nullptr)
+    {
+        CloseHandle(static_cast<HANDLE>(mapping_handle));
+    }
+#else
+    if(ring != nullptr)
+    {
+        munmap(ring, sizeof(shared_frame_ring));
+        shm_unlink(("/" + name).c_str());
+    }
+
+    if(semaphore_handle != nullptr)
+    {
+        sem_close(static_cast<sem_t*>(semaphore_handle));
+        sem_unlink(("/" + name + "_sem").c_str());
+    }
+#endif
+}
+
+bool SharedFrameRing::IsEnabled()
+{
+    json ring_settings = ResourceManager::get()->GetSettingsManager()->GetSettings("SharedFrameRing");
+
+    if(ring_settings.contains("enabled"))
+    {
+        return(ring_settings["enabled"].get<bool>());
+    }
+
+    return(false);
+}
+
+bool SharedFrameRing::IsOpen()
+{
+    return(ring != nullptr);
+}
+
+std::string SharedFrameRing::GetName()
+{
+    return(name);
+}
+
+void SharedFrameRing::WaitForFrame()
+{
+#ifdef _WIN32
+    WaitForSingleObject(static_cast<HANDLE>(semaphore_handle), INFINITE);
+#else
+    while(sem_wait(static_cast<sem_t*>(semaphore_handle)) != 0)
+    {
+        // Retry when interrupted by a signal
+    }
+#endif
+}
+
+void SharedFrameRing::PostFrame()
+{
+#ifdef _WIN32
+    ReleaseSemaphore(static_cast<HANDLE>(semaphore_handle), 1, NULL);
+#else
+    sem_post(static_cast<sem_t*>(semaphore_handle));
+#endif
+}
+
+void SharedFrameRing::ReadFrames()
+{
+    uint64_t write_index = ring->write_index.load(std::memory_order_acquire);
+
+    /*-----------------------------------------------------*\
+    | Skip frames the producer has already overwritten      |
+    \*-----------------------------------------------------*/
+    if(write_index - read_index > SHARED_FRAME_RING_SLOTS)
+    {
+        read_index = write_index - SHARED_FRAME_RING_SLOTS;
+    }
+
+    while(read_index < write_index)
+    {
+        shared_frame_slot*  slot = &ring->slots[read_index % SHARED_FRAME_RING_SLOTS];
+        RGBColor            colors[SHARED_FRAME_RING_MAX_LEDS];
+        uint32_t            seq_start;
+        uint32_t            seq_end;
+        uint32_t            led_count;
+        uint64_t            present_time_ns;
+
+        read_index++;
+
+        seq_start = slot->seq.load(std::memory_order_acquire);
+
+        if(seq_start & 1)
+        {
+            continue;
+        }
+
+        led_count       = slot->led_count;
+        present_time_ns = slot->present_time_ns;
+
+        if(led_count > SHARED_FRAME_RING_MAX_LEDS)
+        {
+            continue;
+        }
+
+        for(uint32_t led_idx = 0; led_idx < led_count; led_idx++)
+        {
+            colors[led_idx] = slot->colors[led_idx];
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        seq_end = slot->seq.load(std::memory_order_relaxed);
+
+        /*-------------------------------------------------*\
+        | The producer lapped us while we were reading      |
+        \*-------------------------------------------------*/
+        if(seq_start != seq_end)
+        {
+            continue;
+        }
+
+        std::chrono::steady_clock::time_point present_time;
+
+        if(present_time_ns != 0)
+        {
+            present_time = std::chrono::steady_clock::time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(present_time_ns)));
+        }
+
+        frame_callback(colors, led_count, present_time);
+    }
+}
+
+void SharedFrameRing::RingThreadFunction()
+{
+    while(ring_thread_run.load())
+    {
+        WaitForFrame();
+
+        if(!ring_thread_run.load())
+        {
+            break;
+        }
+
+        ReadFrames();
+    }
+}
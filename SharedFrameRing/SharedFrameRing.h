@@ -0,0 +1,128 @@
+/*---------------------------------------------------------*\
+| SharedFrameRing.h                                         |
+|                                                           |
+|   Shared memory frame ring for local frame producers      |
+|                                                           |
+|   This file is part of the OpenRGB project                |
+|   SPDX-License-Identifier: GPL-2.0-only                   |
+\*---------------------------------------------------------*/
+
+#pragma once
+
+#include "RGBController.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+
+#define SHARED_FRAME_RING_MAGIC             0x4F524652
+#define SHARED_FRAME_RING_VERSION           1
+#define SHARED_FRAME_RING_SLOTS             16
+#define SHARED_FRAME_RING_MAX_LEDS          8
+
+/*---------------------------------------------------------*\
+| Shared memory layout                                      |
+|                                                           |
+|   The ring is created by OpenRGB as a named mapping       |
+|   (POSIX "/OpenRGB_FrameRing_<key>", Windows              |
+|   "Local\OpenRGB_FrameRing_<key>"), where <key> is the    |
+|   device serial, or without one a key that follows the    |
+|   USB port the device is plugged into, with every         |
+|   character other than A-Z, a-z and 0-9 replaced by an    |
+|   underscore.  The name stays the same across re-plugs    |
+|   into the same port.                                     |
+|                                                           |
+|   A single producer publishes a frame by writing the      |
+|   slot at write_index % SHARED_FRAME_RING_SLOTS between   |
+|   two increments of the slot sequence, incrementing       |
+|   write_index and posting the semaphore of the same name  |
+|   with a "_sem" suffix.  SharedFrameRingWrite() does all  |
+|   but the last step.                                      |
+|                                                           |
+|   present_time_ns is a steady clock (CLOCK_MONOTONIC /    |
+|   QueryPerformanceCounter) time in nanoseconds, or 0 to   |
+|   show the frame as soon as possible.                     |
+\*---------------------------------------------------------*/
+typedef struct
+{
+    std::atomic<uint32_t>   seq;
+    uint32_t                led_count;
+    uint64_t                present_time_ns;
+    uint32_t                colors[SHARED_FRAME_RING_MAX_LEDS];
+} shared_frame_slot;
+
+typedef struct
+{
+    uint32_t                magic;
+    uint32_t                version;
+    uint32_t                slot_count;
+    uint32_t                max_leds;
+    std::atomic<uint64_t>   write_index;
+    shared_frame_slot       slots[SHARED_FRAME_RING_SLOTS];
+} shared_frame_ring;
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "shared frame ring needs lock free 32-bit atomics");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared frame ring needs lock free 64-bit atomics");
+
+inline void SharedFrameRingWrite(shared_frame_ring* ring, const uint32_t* colors, uint32_t led_count, uint64_t present_time_ns)
+{
+    uint64_t            index = ring->write_index.load(std::memory_order_relaxed);
+    shared_frame_slot*  slot  = &ring->slots[index % SHARED_FRAME_RING_SLOTS];
+    uint32_t            seq   = slot->seq.load(std::memory_order_relaxed);
+
+    if(led_count > SHARED_FRAME_RING_MAX_LEDS)
+    {
+        led_count = SHARED_FRAME_RING_MAX_LEDS;
+    }
+
+    slot->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->led_count       = led_count;
+    slot->present_time_ns = present_time_ns;
+
+    for(uint32_t led_idx = 0; led_idx < led_count; led_idx++)
+    {
+        slot->colors[led_idx] = colors[led_idx];
+    }
+
+    slot->seq.store(seq + 2, std::memory_order_release);
+    ring->write_index.store(index + 1, std::memory_order_release);
+}
+
+/*---------------------------------------------------------*\
+| Called on the ring thread for every frame read.  A        |
+| default constructed present_time means as soon as         |
+| possible.                                                 |
+\*---------------------------------------------------------*/
+typedef std::function<void(const RGBColor* colors, unsigned int count, std::chrono::steady_clock::time_point present_time)> SharedFrameCallback;
+
+class SharedFrameRing
+{
+public:
+    SharedFrameRing(const std::string& key, SharedFrameCallback callback);
+    ~SharedFrameRing();
+
+    static bool     IsEnabled();
+
+    bool            IsOpen();
+    std::string     GetName();
+
+private:
+    std::string         name;
+    SharedFrameCallback frame_callback;
+    shared_frame_ring*  ring;
+    uint64_t            read_index;
+    void*               mapping_handle;
+    void*               semaphore_handle;
+
+    std::thread*        ring_thread;
+    std::atomic<bool>   ring_thread_run;
+
+    void                ReadFrames();
+    void                RingThreadFunction();
+    void                WaitForFrame();
+    void                PostFrame();
+};
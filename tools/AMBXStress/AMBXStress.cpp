@@ -0,0 +1,453 @@
+/*---------------------------------------------------------*\
+| AMBXStress.cpp                                            |
+|                                                           |
+|   Publishes frames to one simulated amBX controller from  |
+|   many threads at once and checks every packet the writer |
+|   thread sends for torn or out of order frames            |
+|                                                           |
+|   Build it against the OpenRGB source tree together with  |
+|   the controller folders, it is not part of OpenRGB.      |
+|                                                           |
+|   This file is part of the OpenRGB project                |
+|   SPDX-License-Identifier: GPL-2.0-only                   |
+\*---------------------------------------------------------*/
+
+#include "AMBXController.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*---------------------------------------------------------*\
+| Every color carries who published it so the transport    |
+| can check it.  Red holds the light index and the thread, |
+| green and blue hold the thread's 16 bit frame sequence.  |
+\*---------------------------------------------------------*/
+#define STRESS_MAX_THREADS                  30
+#define STRESS_FINAL_THREAD                 31
+#define STRESS_MAX_FRAMES                   0xFFFF
+#define STRESS_MAX_REPORTED                 10
+
+enum
+{
+    STRESS_MODE_INTERACTIVE = 0,
+    STRESS_MODE_BULK        = 1,
+    STRESS_MODE_SCHEDULED   = 2,
+    STRESS_MODE_COUNT       = 3
+};
+
+static const char* mode_names[] =
+{
+    "interactive",
+    "bulk",
+    "scheduled"
+};
+
+typedef struct
+{
+    unsigned int    threads;
+    unsigned int    frames;
+    unsigned int    latency_us;
+    unsigned int    pause_us;
+    unsigned int    lead_us;
+} stress_options;
+
+static RGBColor EncodeColor(unsigned int light_idx, unsigned int thread_idx, unsigned int seq)
+{
+    return(ToRGBColor((light_idx << 5) | thread_idx, (seq >> 8) & 0xFF, seq & 0xFF));
+}
+
+/*---------------------------------------------------------*\
+| Stands in for the USB bus.  Each packet is checked as it  |
+| arrives:                                                  |
+|   - the packet is a color packet for a known light        |
+|   - the color was published for that light                |
+|   - no two transfers are ever in flight at once           |
+|   - a thread's colors for a light never go backwards      |
+|   - bulk and scheduled threads publish whole frames, so   |
+|     once any light shows frame N of such a thread no      |
+|     light may show an older frame of it again             |
+\*---------------------------------------------------------*/
+class StressTransport
+{
+public:
+    StressTransport(unsigned int latency)
+    {
+        latency_us = latency;
+        in_flight  = false;
+        packets    = 0;
+        failures   = 0;
+
+        for(unsigned int thread_idx = 0; thread_idx <= STRESS_FINAL_THREAD; thread_idx++)
+        {
+            frame_floor[thread_idx] = -1;
+
+            for(unsigned int light_idx = 0; light_idx < AMBX_LIGHT_COUNT; light_idx++)
+            {
+                light_floor[light_idx][thread_idx] = -1;
+            }
+        }
+
+        for(unsigned int light_idx = 0; light_idx < AMBX_LIGHT_COUNT; light_idx++)
+        {
+            last_colors[light_idx] = 0;
+        }
+    }
+
+    int Send(unsigned char* packet, unsigned int size)
+    {
+        if(in_flight.exchange(true))
+        {
+            Fail("two transfers in flight at once");
+        }
+
+        Check(packet, size);
+
+        if(latency_us != 0)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(latency_us));
+        }
+
+        packets++;
+        in_flight = false;
+
+        return((int)size);
+    }
+
+    RGBColor GetLastColor(unsigned int light_idx)
+    {
+        std::lock_guard<std::mutex> lock(check_mutex);
+
+        return(last_colors[light_idx]);
+    }
+
+    unsigned long long GetPackets()
+    {
+        return(packets.load());
+    }
+
+    unsigned long long GetFailures()
+    {
+        return(failures.load());
+    }
+
+private:
+    unsigned int                    latency_us;
+    std::atomic<bool>               in_flight;
+    std::atomic<unsigned long long> packets;
+    std::atomic<unsigned long long> failures;
+
+    std::mutex                      check_mutex;
+    int                             frame_floor[STRESS_FINAL_THREAD + 1];
+    int                             light_floor[AMBX_LIGHT_COUNT][STRESS_FINAL_THREAD + 1];
+    RGBColor                        last_colors[AMBX_LIGHT_COUNT];
+
+    void Fail(const char* reason)
+    {
+        if(failures++ < STRESS_MAX_REPORTED)
+        {
+            printf("FAIL: %s\n", reason);
+        }
+    }
+
+    void Check(unsigned char* packet, unsigned int size)
+    {
+        char reason[128];
+
+        if(size != AMBX_COLOR_PACKET_SIZE || packet[0] != AMBX_PACKET_HEADER || packet[2] != AMBX_SET_COLOR)
+        {
+            Fail("not a color packet");
+            return;
+        }
+
+        int light_idx = AMBXLightIndex(packet[1]);
+
+        if(light_idx < 0)
+        {
+            snprintf(reason, sizeof(reason), "unknown light id 0x%02X", packet[1]);
+            Fail(reason);
+            return;
+        }
+
+        unsigned int encoded_light = packet[3] >> 5;
+        unsigned int thread_idx    = packet[3] & 0x1F;
+        int          seq           = (packet[4] << 8) | packet[5];
+
+        std::lock_guard<std::mutex> lock(check_mutex);
+
+        last_colors[light_idx] = ToRGBColor(packet[3], packet[4], packet[5]);
+
+        if(encoded_light != (unsigned int)light_idx)
+        {
+            snprintf(reason, sizeof(reason), "light %d sent the color of light %u", light_idx, encoded_light);
+            Fail(reason);
+            return;
+        }
+
+        if(seq < light_floor[light_idx][thread_idx])
+        {
+            snprintf(reason, sizeof(reason), "light %d went back from thread %u frame %d to %d", light_idx, thread_idx, light_floor[light_idx][thread_idx], seq);
+            Fail(reason);
+        }
+
+        if(thread_idx != STRESS_FINAL_THREAD && (thread_idx % STRESS_MODE_COUNT) != STRESS_MODE_INTERACTIVE && seq < frame_floor[thread_idx])
+        {
+            snprintf(reason, sizeof(reason), "torn frame, light %d sent thread %u frame %d after frame %d", light_idx, thread_idx, seq, frame_floor[thread_idx]);
+            Fail(reason);
+        }
+
+        light_floor[light_idx][thread_idx] = std::max(light_floor[light_idx][thread_idx], seq);
+        frame_floor[thread_idx]            = std::max(frame_floor[thread_idx], seq);
+    }
+};
+
+/*---------------------------------------------------------*\
+| The thread index picks how it publishes:                  |
+|   interactive  one random light at a time                 |
+|   bulk         all lights as one frame                    |
+|   scheduled    all lights with a presentation time        |
+\*---------------------------------------------------------*/
+static void PublishThread(AMBXController* controller, const stress_options* options, unsigned int thread_idx)
+{
+    std::mt19937                                random(thread_idx);
+    std::uniform_int_distribution<unsigned int> light_dist(0, AMBX_LIGHT_COUNT - 1);
+    std::uniform_int_distribution<unsigned int> pause_dist(0, options->pause_us);
+
+    unsigned int    led_ids[AMBX_LIGHT_COUNT];
+    RGBColor        colors[AMBX_LIGHT_COUNT];
+    unsigned int    mode = thread_idx % STRESS_MODE_COUNT;
+
+    for(unsigned int light_idx = 0; light_idx < AMBX_LIGHT_COUNT; light_idx++)
+    {
+        led_ids[light_idx] = ambx_lights[light_idx].id;
+    }
+
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now();
+
+    for(unsigned int seq = 0; seq < options->frames; seq++)
+    {
+        if(mode == STRESS_MODE_INTERACTIVE)
+        {
+            unsigned int light_idx = light_dist(random);
+
+            controller->SetLEDColor(led_ids[light_idx], EncodeColor(light_idx, thread_idx, seq));
+        }
+        else
+        {
+            for(unsigned int light_idx = 0; light_idx < AMBX_LIGHT_COUNT; light_idx++)
+            {
+                colors[light_idx] = EncodeColor(light_idx, thread_idx, seq);
+            }
+
+            if(mode == STRESS_MODE_BULK)
+            {
+                controller->SetLEDColors(led_ids, colors, AMBX_LIGHT_COUNT);
+            }
+            else
+            {
+                /*-----------------------------------------*\
+                | Deadlines only ever move forward so the   |
+                | thread's frames stay in order             |
+                \*-----------------------------------------*/
+                deadline = std::max(deadline + std::chrono::microseconds(1), std::chrono::steady_clock::now() + std::chrono::microseconds(options->lead_us));
+
+                controller->SetLEDColorsAt(led_ids, colors, AMBX_LIGHT_COUNT, deadline);
+            }
+        }
+
+        if(options->pause_us != 0)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(pause_dist(random)));
+        }
+    }
+}
+
+static void PrintUsage(const char* program)
+{
+    printf("Usage: %s [options]\n", program);
+    printf("  --threads N        publishing threads, 1-%u (default 8)\n", STRESS_MAX_THREADS);
+    printf("  --frames N         frames per thread, 1-%u (default 500)\n", STRESS_MAX_FRAMES);
+    printf("  --latency-us N     transfer time of each packet (default 100)\n");
+    printf("  --pause-us N       random pause between frames, 0-N (default 20000)\n");
+    printf("  --lead-us N        presentation time of scheduled frames (default 20000)\n");
+}
+
+int main(int argc, char* argv[])
+{
+    stress_options options;
+
+    options.threads     = 8;
+    options.frames      = 500;
+    options.latency_us  = 100;
+    options.pause_us    = 20000;
+    options.lead_us     = 20000;
+
+    for(int arg_idx = 1; arg_idx < argc; arg_idx++)
+    {
+        const char* arg   = argv[arg_idx];
+        const char* value = (arg_idx + 1 < argc) ? argv[arg_idx + 1] : nullptr;
+
+        if(value == nullptr)
+        {
+            PrintUsage(argv[0]);
+            return(1);
+        }
+
+        if(strcmp(arg, "--threads") == 0)
+        {
+            options.threads = std::min((unsigned long)STRESS_MAX_THREADS, std::max(1UL, strtoul(value, nullptr, 10)));
+        }
+        else if(strcmp(arg, "--frames") == 0)
+        {
+            options.frames = std::min((unsigned long)STRESS_MAX_FRAMES, std::max(1UL, strtoul(value, nullptr, 10)));
+        }
+        else if(strcmp(arg, "--latency-us") == 0)
+        {
+            options.latency_us = (unsigned int)strtoul(value, nullptr, 10);
+        }
+        else if(strcmp(arg, "--pause-us") == 0)
+        {
+            options.pause_us = (unsigned int)strtoul(value, nullptr, 10);
+        }
+        else if(strcmp(arg, "--lead-us") == 0)
+        {
+            options.lead_us = (unsigned int)strtoul(value, nullptr, 10);
+        }
+        else
+        {
+            PrintUsage(argv[0]);
+            return(1);
+        }
+
+        arg_idx++;
+    }
+
+    printf("%u threads x %u frames, %u us latency, 0-%u us pause, %u us lead\n",
+           options.threads,
+           options.frames,
+           options.latency_us,
+           options.pause_us,
+           options.lead_us);
+
+    for(unsigned int thread_idx = 0; thread_idx < options.threads; thread_idx++)
+    {
+        printf("  thread %2u: %s\n", thread_idx, mode_names[thread_idx % STRESS_MODE_COUNT]);
+    }
+
+    StressTransport     sim(options.latency_us);
+    AMBXController*     controller = new AMBXController("stress", [&sim](unsigned char* packet, unsigned int size)
+    {
+        return(sim.Send(packet, size));
+    });
+
+    controller->SetShutdownBlackout(false);
+
+    std::vector<std::thread>    threads;
+    std::atomic<bool>           publishing(true);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    for(unsigned int thread_idx = 0; thread_idx < options.threads; thread_idx++)
+    {
+        threads.push_back(std::thread(PublishThread, controller, &options, thread_idx));
+    }
+
+    /*-----------------------------------------------------*\
+    | Keep changing the idle timeout meanwhile, each change |
+    | wakes the writer thread without a new frame           |
+    \*-----------------------------------------------------*/
+    std::thread idle_thread([controller, &publishing]
+    {
+        unsigned int toggle = 0;
+
+        while(publishing.load())
+        {
+            controller->SetIdleTimeout((toggle++ & 1) ? 1 : 0);
+            std::this_thread::sleep_for(std::chrono::milliseconds(3));
+        }
+
+        controller->SetIdleTimeout(0);
+    });
+
+    for(unsigned int thread_idx = 0; thread_idx < threads.size(); thread_idx++)
+    {
+        threads[thread_idx].join();
+    }
+
+    publishing = false;
+    idle_thread.join();
+
+    double publish_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    /*-----------------------------------------------------*\
+    | Let the schedule run out, then publish one last frame |
+    | which has to end up on every light                    |
+    \*-----------------------------------------------------*/
+    std::this_thread::sleep_for(std::chrono::microseconds(options.lead_us) + std::chrono::milliseconds(100));
+
+    unsigned int    led_ids[AMBX_LIGHT_COUNT];
+    RGBColor        final_colors[AMBX_LIGHT_COUNT];
+
+    for(unsigned int light_idx = 0; light_idx < AMBX_LIGHT_COUNT; light_idx++)
+    {
+        led_ids[light_idx]      = ambx_lights[light_idx].id;
+        final_colors[light_idx] = EncodeColor(light_idx, STRESS_FINAL_THREAD, STRESS_MAX_FRAMES);
+    }
+
+    controller->SetLEDColors(led_ids, final_colors, AMBX_LIGHT_COUNT);
+
+    bool                                    settled         = false;
+    std::chrono::steady_clock::time_point   settle_deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+
+    while(!settled && std::chrono::steady_clock::now() < settle_deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        settled = true;
+
+        for(unsigned int light_idx = 0; light_idx < AMBX_LIGHT_COUNT; light_idx++)
+        {
+            if(sim.GetLastColor(light_idx) != final_colors[light_idx])
+            {
+                settled = false;
+            }
+        }
+    }
+
+    ambx_deadline_stats deadline_stats = controller->GetDeadlineStats();
+    ambx_idle_stats     idle_stats     = controller->GetIdleStats();
+
+    delete controller;
+
+    printf("\n%llu packets in %.2f s\n", sim.GetPackets(), publish_seconds);
+    printf("scheduled: %llu on time, %llu early, %llu late, %llu dropped, %llu superseded\n",
+           deadline_stats.sent_on_time,
+           deadline_stats.sent_early,
+           deadline_stats.sent_late,
+           deadline_stats.dropped,
+           deadline_stats.superseded);
+    printf("writer thread: %llu wakeups, %llu idle entries\n",
+           idle_stats.writer_wakeups,
+           idle_stats.idle_entries);
+
+    if(!settled)
+    {
+        printf("FAIL: the last frame never reached every light\n");
+    }
+
+    if(!settled || sim.GetFailures() != 0)
+    {
+        printf("FAILED, %llu bad packets\n", sim.GetFailures());
+        return(1);
+    }
+
+    printf("PASSED\n");
+    return(0);
+}
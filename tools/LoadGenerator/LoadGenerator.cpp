@@ -0,0 +1,746 @@
+/*---------------------------------------------------------*\
+| LoadGenerator.cpp                                         |
+|                                                           |
+|   Drives a farm of simulated amBX and Cyborg lights       |
+|   through the real RGBControllers and reports throughput, |
+|   CPU usage and latency as the device count grows         |
+|                                                           |
+|   Build it against the OpenRGB source tree together with  |
+|   the controller folders, it is not part of OpenRGB.      |
+|                                                           |
+|   This file is part of the OpenRGB project                |
+|   SPDX-License-Identifier: GPL-2.0-only                   |
+\*---------------------------------------------------------*/
+
+#include "RGBController_AMBX.h"
+#include "RGBController_MadCatzCyborg.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+/*---------------------------------------------------------*\
+| Latency histogram, 16 linear buckets per power of two     |
+| so percentiles stay within about 6% of the real value     |
+\*---------------------------------------------------------*/
+#define LATENCY_SUB_BITS                    4
+#define LATENCY_SUB_BUCKETS                 (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAJOR_BUCKETS               40
+
+enum
+{
+    WORKLOAD_STATIC     = 0,
+    WORKLOAD_RAINBOW    = 1,
+    WORKLOAD_BREATHING  = 2,
+    WORKLOAD_SCHEDULED  = 3
+};
+
+static const char* workload_names[] =
+{
+    "static",
+    "rainbow",
+    "breathing",
+    "scheduled"
+};
+
+typedef struct
+{
+    unsigned int    ambx_count;
+    unsigned int    cyborg_count;
+    unsigned int    fps;
+    unsigned int    seconds;
+    unsigned int    latency_us;
+    unsigned int    jitter_us;
+    double          error_rate;
+    unsigned int    workload;
+    unsigned int    lead_us;
+    unsigned int    driver_threads;
+    bool            scale;
+} load_options;
+
+class LatencyHistogram
+{
+public:
+    LatencyHistogram()
+    {
+        Reset();
+    }
+
+    void Reset()
+    {
+        for(unsigned int bucket_idx = 0; bucket_idx < LATENCY_MAJOR_BUCKETS * LATENCY_SUB_BUCKETS; bucket_idx++)
+        {
+            buckets[bucket_idx] = 0;
+        }
+
+        count  = 0;
+        max_us = 0;
+    }
+
+    void Record(unsigned long long value_us)
+    {
+        buckets[BucketIndex(value_us)]++;
+        count++;
+
+        unsigned long long current_max = max_us.load();
+
+        while(value_us > current_max && !max_us.compare_exchange_weak(current_max, value_us))
+        {
+        }
+    }
+
+    unsigned long long Count()
+    {
+        return(count.load());
+    }
+
+    unsigned long long Max()
+    {
+        return(max_us.load());
+    }
+
+    unsigned long long Percentile(double percentile)
+    {
+        unsigned long long total = count.load();
+
+        if(total == 0)
+        {
+            return(0);
+        }
+
+        unsigned long long target = (unsigned long long)std::ceil(total * percentile / 100.0);
+        unsigned long long seen   = 0;
+
+        for(unsigned int bucket_idx = 0; bucket_idx < LATENCY_MAJOR_BUCKETS * LATENCY_SUB_BUCKETS; bucket_idx++)
+        {
+            seen += buckets[bucket_idx].load();
+
+            if(seen >= target)
+            {
+                return(std::min(BucketUpperBound(bucket_idx), max_us.load()));
+            }
+        }
+
+        return(max_us.load());
+    }
+
+private:
+    std::atomic<unsigned long long> buckets[LATENCY_MAJOR_BUCKETS * LATENCY_SUB_BUCKETS];
+    std::atomic<unsigned long long> count;
+    std::atomic<unsigned long long> max_us;
+
+    static unsigned int BucketIndex(unsigned long long value_us)
+    {
+        if(value_us < LATENCY_SUB_BUCKETS)
+        {
+            return((unsigned int)value_us);
+        }
+
+        unsigned int msb = 0;
+
+        while((value_us >> (msb + 1)) != 0)
+        {
+            msb++;
+        }
+
+        unsigned int shift = msb - LATENCY_SUB_BITS;
+        unsigned int major = std::min<unsigned int>(shift + 1, LATENCY_MAJOR_BUCKETS - 1);
+        unsigned int sub   = (unsigned int)((value_us >> shift) - LATENCY_SUB_BUCKETS) & (LATENCY_SUB_BUCKETS - 1);
+
+        return((major * LATENCY_SUB_BUCKETS) + sub);
+    }
+
+    static unsigned long long BucketUpperBound(unsigned int bucket_idx)
+    {
+        unsigned int major = bucket_idx / LATENCY_SUB_BUCKETS;
+        unsigned int sub   = bucket_idx % LATENCY_SUB_BUCKETS;
+
+        if(major == 0)
+        {
+            return(sub);
+        }
+
+        return(((unsigned long long)(LATENCY_SUB_BUCKETS + sub + 1) << (major - 1)) - 1);
+    }
+};
+
+/*---------------------------------------------------------*\
+| One simulated light.  The transport sleeps for the        |
+| configured latency, fails a share of the transfers and    |
+| measures the time from frame submission to completion.    |
+\*---------------------------------------------------------*/
+class SimulatedDevice
+{
+public:
+    SimulatedDevice(const load_options& options, unsigned int seed, LatencyHistogram* wire_histogram)
+        : rng(seed), jitter_dist(0, options.jitter_us), error_dist(0.0, 1.0)
+    {
+        latency_us   = options.latency_us;
+        jitter_us    = options.jitter_us;
+        error_rate   = options.error_rate;
+        wire_latency = wire_histogram;
+        submit_ns    = 0;
+        packets      = 0;
+        bytes        = 0;
+        errors       = 0;
+        rgb          = nullptr;
+        is_ambx      = false;
+    }
+
+    int Transfer(unsigned int size)
+    {
+        /*-------------------------------------------------*\
+        | Called from one thread at a time per device, the  |
+        | amBX writer thread or under the Cyborg dev_mutex  |
+        \*-------------------------------------------------*/
+        unsigned int delay_us = latency_us + ((jitter_us != 0) ? jitter_dist(rng) : 0);
+
+        if(delay_us != 0)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(delay_us));
+        }
+
+        long long submitted = submit_ns.load();
+
+        if(submitted != 0)
+        {
+            long long now_ns = std::chrono::steady_clock::now().time_since_epoch().count();
+
+            wire_latency->Record((unsigned long long)std::max(0LL, now_ns - submitted) / 1000);
+        }
+
+        if(error_rate > 0.0 && error_dist(rng) < error_rate)
+        {
+            errors++;
+            return(-1);
+        }
+
+        packets++;
+        bytes += size;
+
+        return((int)size);
+    }
+
+    std::atomic<long long>              submit_ns;
+    std::atomic<unsigned long long>     packets;
+    std::atomic<unsigned long long>     bytes;
+    std::atomic<unsigned long long>     errors;
+    RGBController*                      rgb;
+    bool                                is_ambx;
+
+private:
+    unsigned int                            latency_us;
+    unsigned int                            jitter_us;
+    double                                  error_rate;
+    LatencyHistogram*                       wire_latency;
+    std::mt19937                            rng;
+    std::uniform_int_distribution<unsigned int> jitter_dist;
+    std::uniform_real_distribution<double>  error_dist;
+};
+
+typedef struct
+{
+    unsigned long long  frames;
+    unsigned long long  overruns;
+} driver_stats;
+
+static double GetProcessCPUSeconds()
+{
+#ifdef _WIN32
+    FILETIME creation_time;
+    FILETIME exit_time;
+    FILETIME kernel_time;
+    FILETIME user_time;
+
+    if(!GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time, &kernel_time, &user_time))
+    {
+        return(0.0);
+    }
+
+    ULARGE_INTEGER kernel;
+    ULARGE_INTEGER user;
+
+    kernel.LowPart  = kernel_time.dwLowDateTime;
+    kernel.HighPart = kernel_time.dwHighDateTime;
+    user.LowPart    = user_time.dwLowDateTime;
+    user.HighPart   = user_time.dwHighDateTime;
+
+    return((kernel.QuadPart + user.QuadPart) / 10000000.0);
+#else
+    struct rusage usage;
+
+    if(getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        return(0.0);
+    }
+
+    return(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + ((usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0));
+#endif
+}
+
+static RGBColor HueColor(unsigned int hue, unsigned char value)
+{
+    /*-----------------------------------------------------*\
+    | Fully saturated color for a hue of 0-359              |
+    \*-----------------------------------------------------*/
+    unsigned int sector = (hue % 360) / 60;
+    unsigned int rise   = ((hue % 60) * value) / 60;
+    unsigned int fall   = value - rise;
+
+    switch(sector)
+    {
+        case 0:     return(ToRGBColor(value, rise,  0));
+        case 1:     return(ToRGBColor(fall,  value, 0));
+        case 2:     return(ToRGBColor(0,     value, rise));
+        case 3:     return(ToRGBColor(0,     fall,  value));
+        case 4:     return(ToRGBColor(rise,  0,     value));
+        default:    return(ToRGBColor(value, 0,     fall));
+    }
+}
+
+static void FillFrame(SimulatedDevice* device, unsigned int device_idx, unsigned long long frame, unsigned int fps, unsigned int workload)
+{
+    std::vector<RGBColor>& colors = device->rgb->colors;
+
+    for(unsigned int led_idx = 0; led_idx < colors.size(); led_idx++)
+    {
+        switch(workload)
+        {
+            case WORKLOAD_STATIC:
+                colors[led_idx] = HueColor(device_idx * 37, 255);
+                break;
+
+            case WORKLOAD_BREATHING:
+                {
+                    double          seconds = (double)frame / fps;
+                    unsigned char   level   = (unsigned char)(127.5 * (1.0 - std::cos(seconds * 2.0 * 3.14159265)));
+
+                    colors[led_idx] = HueColor(device_idx * 37, level);
+                }
+                break;
+
+            default:
+                colors[led_idx] = HueColor((unsigned int)((frame * 4) + (led_idx * 40) + (device_idx * 13)), 255);
+                break;
+        }
+    }
+}
+
+static void DriverThreadFunction(std::vector<SimulatedDevice*> devices, unsigned int first_idx, const load_options* options, std::atomic<bool>* run, LatencyHistogram* call_latency, driver_stats* stats)
+{
+    std::chrono::nanoseconds                frame_period(1000000000LL / options->fps);
+    std::chrono::steady_clock::time_point   next_frame = std::chrono::steady_clock::now();
+    unsigned long long                      frame      = 0;
+
+    stats->frames   = 0;
+    stats->overruns = 0;
+
+    while(run->load())
+    {
+        for(unsigned int device_idx = 0; device_idx < devices.size(); device_idx++)
+        {
+            SimulatedDevice* device = devices[device_idx];
+
+            /*---------------------------------------------*\
+            | The Cyborg runs breathing on its own worker   |
+            | thread, there is nothing to push per frame    |
+            \*---------------------------------------------*/
+            if(options->workload == WORKLOAD_BREATHING && !device->is_ambx)
+            {
+                continue;
+            }
+
+            FillFrame(device, first_idx + device_idx, frame, options->fps, options->workload);
+
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+            device->submit_ns = start.time_since_epoch().count();
+
+            /*---------------------------------------------*\
+            | The amBX needs about five packet times to get |
+            | a whole frame out, so the lead has to cover   |
+            | that or every frame arrives late              |
+            \*---------------------------------------------*/
+            if(options->workload == WORKLOAD_SCHEDULED)
+            {
+                std::chrono::steady_clock::time_point present_time = start + std::chrono::microseconds(options->lead_us);
+
+                if(device->is_ambx)
+                {
+                    ((RGBController_AMBX*)device->rgb)->UpdateLEDsAt(present_time);
+                }
+                else
+                {
+                    ((RGBController_MadCatzCyborg*)device->rgb)->UpdateLEDsAt(present_time);
+                }
+            }
+            else
+            {
+                device->rgb->DeviceUpdateLEDs();
+            }
+
+            call_latency->Record((unsigned long long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+
+            stats->frames++;
+        }
+
+        frame++;
+        next_frame += frame_period;
+
+        /*-------------------------------------------------*\
+        | Skip ticks that were missed instead of bursting   |
+        \*-------------------------------------------------*/
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+        if(now > next_frame)
+        {
+            unsigned long long missed = (unsigned long long)((now - next_frame) / frame_period) + 1;
+
+            stats->overruns += missed;
+            frame           += missed;
+            next_frame      += frame_period * missed;
+        }
+
+        std::this_thread::sleep_until(next_frame);
+    }
+}
+
+static void RunStep(const load_options& options, unsigned int ambx_count, unsigned int cyborg_count)
+{
+    LatencyHistogram                                wire_latency;
+    LatencyHistogram                                call_latency;
+    std::vector<std::unique_ptr<SimulatedDevice>>   devices;
+
+    /*-----------------------------------------------------*\
+    | Build the farm                                        |
+    \*-----------------------------------------------------*/
+    for(unsigned int device_idx = 0; device_idx < ambx_count + cyborg_count; device_idx++)
+    {
+        SimulatedDevice* device = new SimulatedDevice(options, 1234 + device_idx, &wire_latency);
+
+        devices.emplace_back(device);
+
+        if(device_idx < ambx_count)
+        {
+            std::string     sim_name   = "ambx-" + std::to_string(device_idx);
+            AMBXController* controller = new AMBXController(sim_name, [device](unsigned char* /*packet*/, unsigned int size)
+            {
+                return(device->Transfer(size));
+            });
+
+            device->is_ambx = true;
+            device->rgb     = new RGBController_AMBX(controller, false);
+        }
+        else
+        {
+            std::string                 sim_name   = "cyborg-" + std::to_string(device_idx - ambx_count);
+            MadCatzCyborgController*    controller = new MadCatzCyborgController(sim_name, [device](const unsigned char* /*report*/, size_t size)
+            {
+                return(device->Transfer((unsigned int)size));
+            });
+
+            controller->Initialize();
+
+            device->is_ambx = false;
+            device->rgb     = new RGBController_MadCatzCyborg(controller, false);
+
+            if(options.workload == WORKLOAD_BREATHING)
+            {
+                RGBController* rgb = device->rgb;
+
+                for(unsigned int mode_idx = 0; mode_idx < rgb->modes.size(); mode_idx++)
+                {
+                    if(rgb->modes[mode_idx].value == MADCATZ_CYBORG_EFFECT_BREATHING)
+                    {
+                        rgb->active_mode = mode_idx;
+                        rgb->modes[mode_idx].colors[0] = HueColor(device_idx * 37, 255);
+                        rgb->DeviceUpdateMode();
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    /*-----------------------------------------------------*\
+    | Only measure the steady state                         |
+    \*-----------------------------------------------------*/
+    wire_latency.Reset();
+
+    for(unsigned int device_idx = 0; device_idx < devices.size(); device_idx++)
+    {
+        devices[device_idx]->packets = 0;
+        devices[device_idx]->bytes   = 0;
+        devices[device_idx]->errors  = 0;
+    }
+
+    unsigned int                        thread_count = std::max(1U, std::min<unsigned int>(options.driver_threads, (unsigned int)devices.size()));
+    std::vector<std::thread>            threads;
+    std::vector<driver_stats>           stats(thread_count);
+    std::atomic<bool>                   run(true);
+
+    double                                  cpu_start  = GetProcessCPUSeconds();
+    std::chrono::steady_clock::time_point   wall_start = std::chrono::steady_clock::now();
+
+    for(unsigned int thread_idx = 0; thread_idx < thread_count; thread_idx++)
+    {
+        std::vector<SimulatedDevice*>   slice;
+        unsigned int                    first_idx = (unsigned int)((devices.size() * thread_idx) / thread_count);
+        unsigned int                    last_idx  = (unsigned int)((devices.size() * (thread_idx + 1)) / thread_count);
+
+        for(unsigned int device_idx = first_idx; device_idx < last_idx; device_idx++)
+        {
+            slice.push_back(devices[device_idx].get());
+        }
+
+        threads.emplace_back(DriverThreadFunction, slice, first_idx, &options, &run, &call_latency, &stats[thread_idx]);
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(options.seconds));
+
+    run = false;
+
+    for(unsigned int thread_idx = 0; thread_idx < thread_count; thread_idx++)
+    {
+        threads[thread_idx].join();
+    }
+
+    double wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+    double cpu_seconds  = GetProcessCPUSeconds() - cpu_start;
+
+    /*-----------------------------------------------------*\
+    | Collect the counters before tearing the farm down     |
+    \*-----------------------------------------------------*/
+    unsigned long long frames    = 0;
+    unsigned long long overruns  = 0;
+    unsigned long long packets   = 0;
+    unsigned long long bytes     = 0;
+    unsigned long long errors    = 0;
+    unsigned long long dropped   = 0;
+    unsigned long long early     = 0;
+    unsigned long long late      = 0;
+
+    for(unsigned int thread_idx = 0; thread_idx < thread_count; thread_idx++)
+    {
+        frames   += stats[thread_idx].frames;
+        overruns += stats[thread_idx].overruns;
+    }
+
+    for(unsigned int device_idx = 0; device_idx < devices.size(); device_idx++)
+    {
+        SimulatedDevice* device = devices[device_idx].get();
+
+        packets += device->packets.load();
+        bytes   += device->bytes.load();
+        errors  += device->errors.load();
+
+        if(device->is_ambx)
+        {
+            ambx_deadline_stats deadline_stats = ((RGBController_AMBX*)device->rgb)->GetDeadlineStats();
+
+            dropped += deadline_stats.dropped + deadline_stats.superseded;
+            early   += deadline_stats.sent_early;
+            late    += deadline_stats.sent_late;
+        }
+        else
+        {
+            cyborg_deadline_stats deadline_stats = ((RGBController_MadCatzCyborg*)device->rgb)->GetDeadlineStats();
+
+            dropped += deadline_stats.dropped + deadline_stats.superseded;
+            early   += deadline_stats.sent_early;
+            late    += deadline_stats.sent_late;
+        }
+    }
+
+    for(unsigned int device_idx = 0; device_idx < devices.size(); device_idx++)
+    {
+        delete devices[device_idx]->rgb;
+    }
+
+    printf("%5u %5u %10.1f %10.1f %9.1f %7llu %7llu %7llu %7llu %7llu %6.1f %7llu %7llu %7llu %7llu %7llu %7llu\n",
+           ambx_count,
+           cyborg_count,
+           frames / wall_seconds,
+           packets / wall_seconds,
+           (bytes / wall_seconds) / 1024.0,
+           errors,
+           early,
+           late,
+           dropped,
+           overruns,
+           (cpu_seconds / wall_seconds) * 100.0,
+           call_latency.Percentile(50.0),
+           call_latency.Percentile(99.0),
+           wire_latency.Percentile(50.0),
+           wire_latency.Percentile(90.0),
+           wire_latency.Percentile(99.0),
+           wire_latency.Max());
+    fflush(stdout);
+}
+
+static void PrintUsage(const char* program)
+{
+    printf("Usage: %s [options]\n", program);
+    printf("  --ambx N           simulated amBX devices (default 8)\n");
+    printf("  --cyborg N         simulated Cyborg devices (default 8)\n");
+    printf("  --fps N            frames per second per device (default 60)\n");
+    printf("  --seconds N        measurement time per step (default 5)\n");
+    printf("  --latency-us N     transfer time of each packet (default 1000)\n");
+    printf("  --jitter-us N      extra random transfer time, 0-N (default 0)\n");
+    printf("  --error-rate P     share of transfers that fail, 0-1 (default 0)\n");
+    printf("  --workload NAME    static, rainbow, breathing or scheduled (default rainbow)\n");
+    printf("  --lead-us N        presentation time of scheduled frames (default 20000)\n");
+    printf("  --threads N        frame driver threads (default 1)\n");
+    printf("  --scale            double the device count from 1 up to the totals\n");
+}
+
+int main(int argc, char* argv[])
+{
+    load_options options;
+
+    options.ambx_count      = 8;
+    options.cyborg_count    = 8;
+    options.fps             = 60;
+    options.seconds         = 5;
+    options.latency_us      = 1000;
+    options.jitter_us       = 0;
+    options.error_rate      = 0.0;
+    options.workload        = WORKLOAD_RAINBOW;
+    options.lead_us         = 20000;
+    options.driver_threads  = 1;
+    options.scale           = false;
+
+    for(int arg_idx = 1; arg_idx < argc; arg_idx++)
+    {
+        const char* arg   = argv[arg_idx];
+        const char* value = (arg_idx + 1 < argc) ? argv[arg_idx + 1] : nullptr;
+
+        if(strcmp(arg, "--scale") == 0)
+        {
+            options.scale = true;
+            continue;
+        }
+
+        if(value == nullptr)
+        {
+            PrintUsage(argv[0]);
+            return(1);
+        }
+
+        if(strcmp(arg, "--ambx") == 0)
+        {
+            options.ambx_count = (unsigned int)strtoul(value, nullptr, 10);
+        }
+        else if(strcmp(arg, "--cyborg") == 0)
+        {
+            options.cyborg_count = (unsigned int)strtoul(value, nullptr, 10);
+        }
+        else if(strcmp(arg, "--fps") == 0)
+        {
+            options.fps = std::max(1UL, strtoul(value, nullptr, 10));
+        }
+        else if(strcmp(arg, "--seconds") == 0)
+        {
+            options.seconds = std::max(1UL, strtoul(value, nullptr, 10));
+        }
+        else if(strcmp(arg, "--latency-us") == 0)
+        {
+            options.latency_us = (unsigned int)strtoul(value, nullptr, 10);
+        }
+        else if(strcmp(arg, "--jitter-us") == 0)
+        {
+            options.jitter_us = (unsigned int)strtoul(value, nullptr, 10);
+        }
+        else if(strcmp(arg, "--error-rate") == 0)
+        {
+            options.error_rate = std::min(1.0, std::max(0.0, strtod(value, nullptr)));
+        }
+        else if(strcmp(arg, "--lead-us") == 0)
+        {
+            options.lead_us = (unsigned int)strtoul(value, nullptr, 10);
+        }
+        else if(strcmp(arg, "--threads") == 0)
+        {
+            options.driver_threads = std::max(1UL, strtoul(value, nullptr, 10));
+        }
+        else if(strcmp(arg, "--workload") == 0)
+        {
+            unsigned int workload_idx;
+
+            for(workload_idx = 0; workload_idx < sizeof(workload_names) / sizeof(workload_names[0]); workload_idx++)
+            {
+                if(strcmp(value, workload_names[workload_idx]) == 0)
+                {
+                    break;
+                }
+            }
+
+            if(workload_idx == sizeof(workload_names) / sizeof(workload_names[0]))
+            {
+                PrintUsage(argv[0]);
+                return(1);
+            }
+
+            options.workload = workload_idx;
+        }
+        else
+        {
+            PrintUsage(argv[0]);
+            return(1);
+        }
+
+        arg_idx++;
+    }
+
+    if(options.ambx_count + options.cyborg_count == 0)
+    {
+        PrintUsage(argv[0]);
+        return(1);
+    }
+
+    printf("workload %s, %u fps, %u us latency + 0-%u us jitter, error rate %.4f, %u driver thread(s), %u cores\n",
+           workload_names[options.workload],
+           options.fps,
+           options.latency_us,
+           options.jitter_us,
+           options.error_rate,
+           options.driver_threads,
+           std::thread::hardware_concurrency());
+    printf("CPU %% is of one core, call is the time spent in the RGBController, wire is frame submit to transfer done (us)\n\n");
+    printf(" ambx cybrg   frames/s  packets/s      KiB/s  errors   early    late dropped overrun   CPU%% call50  call99  wire50  wire90  wire99 wiremax\n");
+
+    if(!options.scale)
+    {
+        RunStep(options, options.ambx_count, options.cyborg_count);
+        return(0);
+    }
+
+    for(unsigned int step = 1; ; step *= 2)
+    {
+        unsigned int ambx_count   = std::min(options.ambx_count, step);
+        unsigned int cyborg_count = std::min(options.cyborg_count, step);
+
+        RunStep(options, ambx_count, cyborg_count);
+
+        if(ambx_count == options.ambx_count && cyborg_count == options.cyborg_count)
+        {
+            break;
+        }
+    }
+
+    return(0);
+}